@@ -2,9 +2,16 @@
 #ifndef ALGEBRA_HPP_
 #define ALGEBRA_HPP_
 
+#include "arena.hpp"
+#include "computed_table.hpp"
+#include "intern.hpp"
+#include "small_vector.hpp"
+
 #include <cstddef>
+#include <cstdint>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <unordered_set>
@@ -16,6 +23,124 @@ namespace algebra {
     typedef size_t MononodeHash;
     typedef size_t PolynodeHash;
 
+    // Dense handles into the arenas of a NodeStore
+    typedef Id NodeId;
+    typedef Id MononodeId;
+    typedef Id PolynodeId;
+
+    // A node with its (positive) exponent in a mononode
+    // key caches the order key of the node, which is unique within its store
+    struct Factor {
+        uint64_t key;
+        NodeId id;
+        int exp;
+
+        bool operator==(const Factor& other) const { return id == other.id && exp == other.exp; }
+    };
+
+    // Factors of a mononode, sorted by NodeStore::node_cmp
+    typedef SmallVector<Factor, 4> FactorVec;
+
+    // Mononodes compare as the lexicographic order on these words, see NodeStore::mononode_cmp
+    typedef SmallVector<uint64_t, 8> MononodeKey;
+
+    // The variables occurring in a node, including inside every f(polynode)
+    //
+    // Exact for the variables in [0, MAX), any other variable only sets other, 
+    // so the answers about those are conservative
+    struct VarSet {
+        static constexpr Idx MAX = 64;
+
+        uint64_t bits = 0;
+        bool other = false;
+
+        static VarSet of(const Idx var) {
+            VarSet res;
+            if (var >= 0 && var < MAX) res.bits = uint64_t(1) << var;
+            else res.other = true;
+            return res;
+        }
+
+        VarSet& operator|=(const VarSet& rhs) {
+            bits |= rhs.bits;
+            other |= rhs.other;
+            return *this;
+        }
+
+        bool empty() const { return bits == 0 && !other; }
+        // Whether the answers below are exact
+        bool exact() const { return !other; }
+
+        // May be a false positive outside [0, MAX)
+        bool contains(const Idx var) const { return var >= 0 && var < MAX ? (bits >> var & 1) : other; }
+        bool intersects(const VarSet& rhs) const { return (bits & rhs.bits) != 0 || (other && rhs.other); }
+        // May be a false negative if this is not exact
+        bool subset_of(const VarSet& rhs) const { return (bits & ~rhs.bits) == 0 && (!other || rhs.other); }
+
+        // In increasing order, only the ones in [0, MAX)
+        std::vector<Idx> to_vector() const;
+    };
+
+    // Exponents of a mononode of the variables x0..x15 alone, one byte each, all below 128
+    //
+    // The top bit of every byte stays clear, so two of them compare, add, subtract and take
+    // maxima a word at a time, the carry out of a byte landing in its own top bit
+    struct PackedExps {
+        static constexpr Idx LANES = 16;
+        static constexpr int MAX_EXP = 127;
+
+        // The top bit of every byte
+        static constexpr uint64_t HIGH = 0x8080808080808080;
+
+        uint64_t lo = 0; // x0..x7
+        uint64_t hi = 0; // x8..x15
+        bool valid = false;
+
+        static bool fits(const Idx var, const int exp) { return var >= 0 && var < LANES && exp <= MAX_EXP; }
+
+        int get(const Idx var) const { return int(((var < 8 ? lo : hi) >> (8 * (var % 8))) & 0xff); }
+        void set(const Idx var, const int exp) { (var < 8 ? lo : hi) |= uint64_t(exp) << (8 * (var % 8)); }
+
+        // The top bit of every byte where lhs >= rhs
+        static uint64_t geq(const uint64_t lhs, const uint64_t rhs) { return ((lhs | HIGH) - rhs) & HIGH; }
+
+        static uint64_t max(const uint64_t lhs, const uint64_t rhs) {
+            const uint64_t take_lhs = (geq(lhs, rhs) >> 7) * 0xff;
+            return (lhs & take_lhs) | (rhs & ~take_lhs);
+        }
+
+        // Both must be valid
+        bool divisible(const PackedExps& rhs) const { return geq(lo, rhs.lo) == HIGH && geq(hi, rhs.hi) == HIGH; }
+
+        // Invalid if an exponent reaches 128
+        PackedExps operator+(const PackedExps& rhs) const {
+            PackedExps res;
+            res.lo = lo + rhs.lo;
+            res.hi = hi + rhs.hi;
+            res.valid = valid && rhs.valid && ((res.lo | res.hi) & HIGH) == 0;
+            return res;
+        }
+
+        // Assumes rhs | this
+        PackedExps operator-(const PackedExps& rhs) const {
+            PackedExps res;
+            res.lo = lo - rhs.lo;
+            res.hi = hi - rhs.hi;
+            res.valid = valid && rhs.valid;
+            return res;
+        }
+
+        PackedExps lcm(const PackedExps& rhs) const {
+            PackedExps res;
+            res.lo = max(lo, rhs.lo);
+            res.hi = max(hi, rhs.hi);
+            res.valid = valid && rhs.valid;
+            return res;
+        }
+
+        bool operator==(const PackedExps& rhs) const { return valid == rhs.valid && lo == rhs.lo && hi == rhs.hi; }
+    };
+
     struct NodeStats;
     std::ostream& operator<<(std::ostream& os, const algebra::NodeStats& s);
 
@@ -24,9 +149,11 @@ namespace algebra {
         int nested_weight;
         int depth;
         int length_approx; // Approximate length of the node, treating all constants except \pm 1 as length 1 
+        VarSet vars;
 
         NodeStats() = default;
-        NodeStats(const int weight, const int nested_weight, const int depth, const int length_approx);
+        NodeStats(const int weight, const int nested_weight, const int depth, const int length_approx,
+                const VarSet vars = VarSet());
 
         NodeStats& add_node(const NodeStats& rhs, int exp);
         NodeStats& add_mononode(const NodeStats& rhs, bool is_one); // Whether the coefficient is 1
@@ -40,9 +167,11 @@ namespace algebra {
     public:
         const Hash hash;
         const NodeStats stats;
+        Id id; // Assigned by the NodeStore on insertion
 
         NodeBase(const Hash hash, const NodeStats stats);
 
+        // Objects are hash-consed, so equality is identity within a store
         bool operator==(const NodeBase<Hash>& rhs) const;
         bool operator!=(const NodeBase<Hash>& rhs) const;
     };
@@ -61,47 +190,155 @@ namespace algebra {
     template<class R>
     class Polynode;
 
+    template<class R>
+    class Geobucket;
+
+    // Interns every Node, Mononode and Polynode exactly once
+    //
+    // Objects live in arenas and are addressed by dense 32-bit ids, 
+    // hashes are only used to find an existing object on insertion
+    //
+    // Hashes are evaluations modulo 2^61 - 1, so the hash of a product, quotient, sum, 
+    // negation or scaling follows from the hashes of its operands
+    //
+    // Once concurrent, any number of threads can intern objects and do arithmetic in the store at once.
+    // The intern and computed tables are sharded behind locks, objects never move, 
+    // and looking up an object by its id takes no lock at all.
+    // Garbage collection, pins, reset and the cache size remain single threaded
     template<class R>
     class NodeStore {
     private:
-        std::unordered_map<NodeHash, Node<R>> nodes_;
-        std::unordered_map<MononodeHash, Mononode<R>> mononodes_;
-        std::unordered_map<PolynodeHash, Polynode<R>> polynodes_;
+        Arena<Node<R>> nodes_;
+        Arena<Mononode<R>> mononodes_;
+        Arena<Polynode<R>> polynodes_;
+
+        ShardedInternTable node_ids_;
+        ShardedInternTable mononode_ids_;
+        ShardedInternTable polynode_ids_;
+
+        // Order keys in use by nodes
+        std::unordered_set<uint64_t> node_keys_;
+
+        // Only taken while concurrent, always after the lock of an intern shard
+        bool concurrent_;
+        std::mutex nodes_mutex_;
+        std::mutex mononodes_mutex_;
+        std::mutex polynodes_mutex_;
+        std::mutex node_keys_mutex_;
+
+        std::unique_lock<std::mutex> lock(std::mutex &m) const {
+            return concurrent_ ? std::unique_lock<std::mutex>(m) : std::unique_lock<std::mutex>();
+        }
+
+        // Objects are built before the lock is taken, it only covers the slot
+        template<class T>
+        Id emplace(Arena<T> &arena, std::mutex &m, T&& object) {
+            std::unique_lock<std::mutex> guard = lock(m);
+            return arena.emplace(std::move(object));
+        }
+
+        // Pin counts of polynodes that survive every collection
+        std::unordered_map<PolynodeId, int> pinned_;
     
+        size_t seed_;
         size_t conj_;
 
+        // Memoized results of polynode arithmetic
+        ComputedTable computed_;
+
+        // The node of each variable with a lane in PackedExps, set whenever one is interned.
+        // Only read for lanes of live mononodes, whose variables are then live too
+        NodeId var_nodes_[PackedExps::LANES];
+
+        MononodeId one_m_;
+        PolynodeId zero_p_;
+        PolynodeId one_p_;
+
+        void init_constants();
+
+        // Returns the first unused order key from key on, and reserves it
+        uint64_t claim_node_key(uint64_t key);
         void dump() const;
+
+        // Find or insert from an already clean key. Nothing is constructed for a repeat
+        // The hash must be the one the key would get from hash_factors/hash_summands
+        const Mononode<R>* intern_mononode(FactorVec&& factors, const MononodeHash hash);
+        const Polynode<R>* intern_polynode(std::vector<std::pair<MononodeId, R>>&& summands);
+        const Polynode<R>* intern_polynode(std::vector<std::pair<MononodeId, R>>&& summands, 
+                const PolynodeHash hash, const bool homomorphic);
+
+        // Find an interned object from its hash alone, Eq confirms each candidate
+        // Returns nullptr if there is none
+        template<class Eq>
+        const Mononode<R>* find_mononode(const MononodeHash hash, Eq&& eq) const;
+        template<class Eq>
+        const Polynode<R>* find_polynode(const PolynodeHash hash, Eq&& eq) const;
+
+        friend class Mononode<R>;
+        friend class Polynode<R>;
+        friend class Geobucket<R>;
     public:
-        NodeStore(const size_t seed = 0);
+        static constexpr int DEFAULT_CACHE_BITS = 16;
+
+        NodeStore(const size_t seed = 0, const int cache_bits = DEFAULT_CACHE_BITS);
+
+        NodeStore(const NodeStore& other) = delete;
+        NodeStore& operator=(const NodeStore& other) = delete;
 
         size_t hash(const size_t n) const;
 
-        const Node<R>* get_node(const NodeHash hash) const;
-        const Mononode<R>* get_mononode(const MononodeHash hash) const;
-        const Polynode<R>* get_polynode(const PolynodeHash hash) const;
+        // Stores with the same seed order nodes the same way, whatever R is
+        size_t get_seed() const;
+
+        const Node<R>* get_node(const NodeId id) const;
+        const Mononode<R>* get_mononode(const MononodeId id) const;
+        const Polynode<R>* get_polynode(const PolynodeId id) const;
 
-        const Node<R>* node(const PolynodeHash pol);
+        const Node<R>* node(const PolynodeId pol);
         const Node<R>* node(const Idx var);
 
-        const Mononode<R>* mononode(const std::unordered_map<NodeHash, int>& factors);
+        const Mononode<R>* mononode(const std::unordered_map<NodeId, int>& factors);
 
-        const Polynode<R>* polynode(const std::vector<std::pair<MononodeHash, R>>& summands);
+        const Polynode<R>* polynode(const std::vector<std::pair<MononodeId, R>>& summands);
 
         const Mononode<R>* one_m();
 
         const Polynode<R>* zero_p();
         const Polynode<R>* one_p();
 
-        const Node<R>* insert_node(Node<R>&& node);
-        const Mononode<R>* insert_mononode(Mononode<R>&& mononode);
-        const Polynode<R>* insert_polynode(Polynode<R>&& polynode);
+        int node_cmp(const NodeId lhs, const NodeId rhs) const;
+
+        // node_cmp on factors, without looking up the nodes
+        static int factor_cmp(const Factor& lhs, const Factor& rhs) {
+            return lhs.key == rhs.key ? 0 : (lhs.key < rhs.key ? -1 : 1);
+        }
+        int mononode_cmp(const MononodeId lhs, const MononodeId rhs) const;
+
+        // Roots for garbage collection, pins are counted
+        void pin(const Polynode<R>* p);
+        void unpin(const Polynode<R>* p);
+
+        // Mark and sweep: destroys every object that is not reachable from the constants, 
+        // the pinned polynodes or the given roots, and returns how many were destroyed
+        //
+        // Pointers to destroyed objects dangle, and their ids are reused
+        size_t collect(const std::vector<PolynodeId> &roots = {}, const std::vector<MononodeId> &mononode_roots = {});
 
-        int node_cmp(const NodeHash lhs, const NodeHash rhs) const;
-        int mononode_cmp(const MononodeHash lhs, const MononodeHash rhs) const;
+        // Whether several threads may use the store at once, not to be changed while they do
+        void set_concurrent(const bool concurrent);
+        bool is_concurrent() const;
 
+        // Resizes (and clears) the computed table to 1 << bits entries, 0 disables it
+        void set_cache_bits(const int bits);
+        const ComputedTable& get_cache() const;
+
+        // Number of live objects
         size_t get_node_store_size() const;
         size_t get_mononode_store_size() const;
         size_t get_polynode_store_size() const;
+
+        // Forget everything in O(1), invalidating all ids and pointers handed out so far
+        void reset();
     };
 
     // Nodes are either:
@@ -115,26 +352,31 @@ namespace algebra {
     template<class R>
     class Node : public NodeBase<NodeHash> {
     private:
+        const NodeHash inv_hash_;
         const NodeType type_;
 
-        const PolynodeHash pol_;
+        // Position in the node order, assigned by the store to be unique
+        uint64_t order_key_;
+
+        const PolynodeId pol_;
         const Idx var_;
 
         NodeStore<R> &node_store_;
 
-    public:
-        Node(const PolynodeHash pol, NodeStore<R> &node_store);
-        Node(const Idx var, NodeStore<R> &node_store);
+        Node(const PolynodeId pol, const NodeHash hash, NodeStore<R> &node_store);
+        Node(const Idx var, const NodeHash hash, NodeStore<R> &node_store);
 
+    public:
         Node(const Node& other) = delete;
         Node(Node&& other) = default;
 
         std::string to_string() const;
 
         NodeType get_type() const;
-        PolynodeHash get_polynode_hash() const;
+        PolynodeId get_polynode_id() const;
         Idx get_var() const;
 
+        friend class Mononode<R>;
         friend class Polynode<R>;
         friend class NodeStore<R>;
     };
@@ -144,22 +386,42 @@ namespace algebra {
     template <class R>
     class Mononode : public NodeBase<MononodeHash> {
     private:
-        const std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>> factors_;
+        const MononodeHash inv_hash_;
+        const FactorVec factors_;
         const int var_degree_;
         const int pol_degree_;
+        const MononodeKey order_key_;
+        const PackedExps packed_;
+        const uint64_t sieve_;
 
         NodeStore<R> &node_store_;
 
-        static std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>> clean_factors(
-                const std::unordered_map<NodeHash, int> &factors, NodeStore<R> &node_store);
+        static uint64_t make_sieve(const FactorVec &factors, const NodeStore<R> &node_store);
+
+        static PackedExps pack(const FactorVec &factors, const NodeStore<R> &node_store);
+
+        // The factors of a valid packed mononode, which must only have variables that are interned
+        static FactorVec unpack(const PackedExps &packed, const NodeStore<R> &node_store);
+
+        static FactorVec clean_factors(const std::unordered_map<NodeId, int> &factors, NodeStore<R> &node_store);
+
+        static MononodeHash hash_factors(const FactorVec &factors, const NodeStore<R> &node_store);
+
+        static MononodeKey make_key(const FactorVec &factors, const int var_degree, const int pol_degree);
 
         // Private constructor with move assumes correct sorting in map
-        Mononode(const std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>&& factors, 
-                NodeStore<R> &node_store);
+        Mononode(FactorVec&& factors, const MononodeHash hash, NodeStore<R> &node_store);
 
-    public:
-        Mononode(const std::unordered_map<NodeHash, int>& factors, NodeStore<R> &node_store);
+        // Whether this = lhs * rhs, without building the product
+        bool is_product(const Mononode<R>& lhs, const Mononode<R>& rhs) const;
 
+        // Walks the union of the factors of lhs and rhs in order, calling
+        // op(const Factor& node, int lhs_exp, int rhs_exp) with 0 for a missing exponent
+        // Stops early, returning false, as soon as op returns false
+        template<class Op>
+        bool merge(const Mononode<R>& rhs, Op&& op) const;
+
+    public:
         Mononode(const Mononode& other) = delete;
         Mononode(Mononode&& other) = default;
 
@@ -167,6 +429,9 @@ namespace algebra {
                        
         const Mononode<R>* operator*(const Mononode<R>& rhs) const;
 
+        // Return lhs / rhs, assuming rhs | lhs
+        const Mononode<R>* operator/(const Mononode<R>& rhs) const;
+
         // Return lcm(lhs, rhs)
         const Mononode<R>* lcm(const Mononode<R>& rhs) const;
 
@@ -176,9 +441,12 @@ namespace algebra {
         // Returns if rhs | lhs
         bool divisible(const Mononode<R>& rhs) const;
 
+        // One bit per factor node, picked by its hash. If rhs | lhs, every bit of rhs is set in lhs
+        uint64_t get_sieve() const;
+
         // Allows iteration over factors
-        std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>::const_iterator begin() const;
-        std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>::const_iterator end() const;
+        FactorVec::const_iterator begin() const;
+        FactorVec::const_iterator end() const;
 
         int get_degree() const;
         
@@ -189,18 +457,27 @@ namespace algebra {
     template<class R>
     class Polynode : public NodeBase<PolynodeHash> {
     private:
-        const std::vector<std::pair<MononodeHash, R>> summands_;
+        const std::vector<std::pair<MononodeId, R>> summands_;
+
+        // Whether the hash is the evaluation of the polynode,
+        // false if a denominator vanishes modulo 2^61 - 1 (then no hash can be derived from it)
+        const bool homomorphic_;
 
         NodeStore<R> &node_store_;
 
-        static std::vector<std::pair<MononodeHash, R>> clean_summands(
-                const std::vector<std::pair<MononodeHash, R>> &summands, NodeStore<R> &node_store);
+        static std::vector<std::pair<MononodeId, R>> clean_summands(
+                const std::vector<std::pair<MononodeId, R>> &summands, NodeStore<R> &node_store);
+
+        static PolynodeHash hash_summands(const std::vector<std::pair<MononodeId, R>> &summands, 
+                const NodeStore<R> &node_store, bool &homomorphic);
 
         // Private constructor with move assumes already sorted "keys"
-        Polynode(const std::vector<std::pair<MononodeHash, R>>&& summands, NodeStore<R> &node_store);
-    public:
-        Polynode(const std::vector<std::pair<MononodeHash, R>>& summands, NodeStore<R> &node_store);
+        Polynode(std::vector<std::pair<MononodeId, R>>&& summands, const PolynodeHash hash, 
+                const bool homomorphic, NodeStore<R> &node_store);
 
+        // Whether this = -rhs, without building the negation
+        bool is_negation(const Polynode<R>& rhs) const;
+    public:
         Polynode(const Polynode& other) = delete;
         Polynode(Polynode&& other) = default;
 
@@ -215,6 +492,9 @@ namespace algebra {
         // Scale by c * m
         const Polynode<R>* scale(const Mononode<R>& m, const R c) const;
 
+        // this - c * m * q, in a single pass and without interning c * m * q
+        const Polynode<R>* sub_scaled(const R c, const Mononode<R>& m, const Polynode<R>& q) const;
+
         // Leading monomial
         const Mononode<R>* leading_m() const;
 
@@ -222,8 +502,8 @@ namespace algebra {
         const R leading_c() const;
 
         // Allows iteration over summands
-        typename std::vector<std::pair<MononodeHash, R>>::const_iterator begin() const;
-        typename std::vector<std::pair<MononodeHash, R>>::const_iterator end() const;
+        typename std::vector<std::pair<MononodeId, R>>::const_iterator begin() const;
+        typename std::vector<std::pair<MononodeId, R>>::const_iterator end() const;
 
         // Substitute a variable by a polynode (general function)
         const Polynode<R>* sub(const Idx var, const Polynode<R>& val) const;
@@ -237,6 +517,8 @@ namespace algebra {
         // Given the equation this = 0, 
         // apply f to both sides of the equation this + rhs = rhs
         const Polynode<R>* apply_func(const Polynode<R>& rhs) const;
+
+        friend class NodeStore<R>;
     };
 }; 
 
@@ -0,0 +1,152 @@
+// arena.hpp
+#ifndef ARENA_HPP_
+#define ARENA_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace algebra {
+    typedef uint32_t Id;
+
+    // Append-only storage for interned objects, addressed by dense ids
+    //
+    // Chunk k holds (1 << (FirstChunkBits + k)) slots, so a 32-bit id space needs
+    // only a handful of chunks, and objects never move once they are constructed.
+    //
+    // reset() is O(1): it only rewinds the size. Old objects are destroyed lazily
+    // when their slot is reused, or when the arena itself is destroyed
+    //
+    // erase() destroys a single object right away, and its id is handed out again 
+    // by a later emplace(), so ids stay dense under garbage collection
+    //
+    // Live objects never move, so nothing is compacted: trim() only gives back the erased
+    // slots at the end of the id range, and the chunks past them
+    template<class T, int FirstChunkBits = 8>
+    class Arena {
+    private:
+        static constexpr int MAX_CHUNKS = 33 - FirstChunkBits;
+
+        T* chunks_[MAX_CHUNKS];
+        Id size_;
+        Id constructed_; // Slots [0, constructed_) hold an object, dead or alive, unless erased
+
+        std::vector<bool> erased_; // Whether each slot below constructed_ was destroyed by erase()
+        std::vector<Id> free_; // Erased ids below size_, to be reused
+
+        static int chunk_of(const uint64_t shifted) {
+            return 63 - __builtin_clzll(shifted) - FirstChunkBits;
+        }
+
+        T* slot(const Id id) const {
+            const uint64_t shifted = uint64_t(id) + (uint64_t(1) << FirstChunkBits);
+            const int chunk = chunk_of(shifted);
+            return chunks_[chunk] + (shifted - (uint64_t(1) << (chunk + FirstChunkBits)));
+        }
+
+    public:
+        Arena() : chunks_(), size_(0), constructed_(0) {}
+
+        Arena(const Arena& other) = delete;
+        Arena& operator=(const Arena& other) = delete;
+
+        ~Arena() {
+            for (Id id = 0; id < constructed_; id++) {
+                if (!erased_[id]) slot(id)->~T();
+            }
+            for (T* chunk : chunks_) ::operator delete(chunk);
+        }
+
+        template<class... Args>
+        Id emplace(Args&&... args) {
+            if (!free_.empty()) {
+                const Id id = free_.back();
+                new (slot(id)) T(std::forward<Args>(args)...);
+                free_.pop_back();
+                erased_[id] = false;
+                return id;
+            }
+
+            const Id id = size_;
+            const uint64_t shifted = uint64_t(id) + (uint64_t(1) << FirstChunkBits);
+            const int chunk = chunk_of(shifted);
+            if (chunks_[chunk] == nullptr) {
+                chunks_[chunk] = static_cast<T*>(::operator new(sizeof(T) << (chunk + FirstChunkBits)));
+            }
+
+            T* ptr = slot(id);
+            if (id < constructed_ && !erased_[id]) {
+                ptr->~T();
+                try {
+                    new (ptr) T(std::forward<Args>(args)...);
+                } catch (...) {
+                    // Leak the dead tail rather than destroying this slot twice
+                    constructed_ = id;
+                    erased_.resize(id);
+                    throw;
+                }
+            } else {
+                new (ptr) T(std::forward<Args>(args)...);
+                if (id < constructed_) {
+                    erased_[id] = false;
+                } else {
+                    constructed_ = id + 1;
+                    erased_.push_back(false);
+                }
+            }
+
+            size_++;
+            return id;
+        }
+
+        // Destroys the object with this id, which must be alive
+        void erase(const Id id) {
+            slot(id)->~T();
+            erased_[id] = true;
+            free_.push_back(id);
+        }
+
+        // Whether id refers to a live object
+        bool alive(const Id id) const { return id < size_ && !erased_[id]; }
+
+        T& operator[](const Id id) { return *slot(id); }
+        const T& operator[](const Id id) const { return *slot(id); }
+
+        // One past the largest id in use
+        Id size() const { return size_; }
+
+        // Number of live objects
+        Id count() const { return size_ - Id(free_.size()); }
+
+        // Lowers size() to one past the largest live id, destroys whatever reset() left behind,
+        // and releases every chunk that no longer holds a slot below size()
+        void trim() {
+            for (Id id = size_; id < constructed_; id++) {
+                if (!erased_[id]) slot(id)->~T();
+            }
+            while (size_ > 0 && erased_[size_ - 1]) size_--;
+            constructed_ = size_;
+            erased_.resize(size_);
+            free_.erase(std::remove_if(free_.begin(), free_.end(), [this](const Id id) { return id >= size_; }), 
+                    free_.end());
+
+            for (int chunk = 0; chunk < MAX_CHUNKS; chunk++) {
+                const uint64_t first = (uint64_t(1) << (chunk + FirstChunkBits)) - (uint64_t(1) << FirstChunkBits);
+                if (chunks_[chunk] != nullptr && first >= size_) {
+                    ::operator delete(chunks_[chunk]);
+                    chunks_[chunk] = nullptr;
+                }
+            }
+        }
+
+        void reset() { 
+            size_ = 0; 
+            free_.clear();
+        }
+    };
+};
+
+#endif
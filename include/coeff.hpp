@@ -0,0 +1,191 @@
+// coeff.hpp
+#ifndef COEFF_HPP_
+#define COEFF_HPP_
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+#include <gmpxx.h>
+
+namespace coeff {
+    // An element of Z/pZ for a prime p < 2^31, held in a machine word
+    //
+    // The modulus is shared by every ModP of a thread, so set it before building anything.
+    // Z/pZ has no order, so the comparisons and abs go by the sign of the small fraction
+    // the element reconstructs to (see rational), which is only meant for printing
+    class ModP {
+    private:
+        static thread_local uint32_t p_;
+
+        uint32_t v_;
+
+        struct Raw {};
+        ModP(const uint32_t v, Raw) : v_(v) {}
+
+    public:
+        // Largest prime below 2^31
+        static constexpr uint32_t DEFAULT_PRIME = 2147483647;
+
+        // Throws std::invalid_argument unless 2 < p < 2^31, primality is up to the caller
+        static void set_prime(const uint32_t p);
+        static uint32_t prime() { return p_; }
+
+        ModP() : v_(0) {}
+        ModP(const int64_t n) : v_(uint32_t(n >= 0 ? n % p_ : p_ - 1 - (-(n + 1)) % p_)) {}
+        ModP(const int n) : ModP(int64_t(n)) {}
+
+        uint32_t value() const { return v_; }
+
+        // The representative in (-p/2, p/2]
+        int64_t signed_value() const { return v_ > p_ / 2 ? int64_t(v_) - p_ : int64_t(v_); }
+
+        // Throws std::domain_error for 0
+        ModP inverse() const;
+
+        // Rational reconstruction: finds num / den = this with |num|, den <= sqrt(p / 2), if there is one.
+        // It is unique, and for the coefficients of most inputs it is the rational one would get over Q
+        bool rational(int64_t &num, int64_t &den) const;
+
+        // Sign of the reconstructed fraction, or of the representative in (-p/2, p/2] if there is none
+        int sign() const;
+
+        ModP operator-() const { return ModP(v_ == 0 ? 0 : p_ - v_, Raw()); }
+
+        ModP& operator+=(const ModP& rhs) {
+            v_ += rhs.v_; // No overflow, both are below 2^31
+            if (v_ >= p_) v_ -= p_;
+            return *this;
+        }
+        ModP& operator-=(const ModP& rhs) {
+            v_ = v_ >= rhs.v_ ? v_ - rhs.v_ : v_ + (p_ - rhs.v_);
+            return *this;
+        }
+        ModP& operator*=(const ModP& rhs) {
+            v_ = uint32_t(uint64_t(v_) * rhs.v_ % p_);
+            return *this;
+        }
+        ModP& operator/=(const ModP& rhs) { return *this *= rhs.inverse(); }
+
+        friend ModP operator+(ModP lhs, const ModP& rhs) { return lhs += rhs; }
+        friend ModP operator-(ModP lhs, const ModP& rhs) { return lhs -= rhs; }
+        friend ModP operator*(ModP lhs, const ModP& rhs) { return lhs *= rhs; }
+        friend ModP operator/(ModP lhs, const ModP& rhs) { return lhs /= rhs; }
+
+        friend bool operator==(const ModP& lhs, const ModP& rhs) { return lhs.v_ == rhs.v_; }
+        friend bool operator!=(const ModP& lhs, const ModP& rhs) { return lhs.v_ != rhs.v_; }
+
+        friend bool operator<(const ModP& lhs, const ModP& rhs) { return (lhs - rhs).sign() < 0; }
+        friend bool operator>(const ModP& lhs, const ModP& rhs) { return rhs < lhs; }
+        friend bool operator<=(const ModP& lhs, const ModP& rhs) { return !(rhs < lhs); }
+        friend bool operator>=(const ModP& lhs, const ModP& rhs) { return !(lhs < rhs); }
+
+        friend ModP abs(const ModP& x) { return x.sign() < 0 ? -x : x; }
+    };
+
+    // The reconstructed fraction if there is one, else the representative in (-p/2, p/2]
+    std::string to_string(const ModP& x);
+
+    // Parses an integer or a fraction a/b, reduced mod the current prime
+    // Throws std::invalid_argument if it does not parse, or b is divisible by the prime
+    ModP parse_mod_p(const std::string& input);
+
+    // A rational number held inline as a pair of int64s, or in an mpq_class once it outgrows them
+    //
+    // The fast paths are overflow checked int64 arithmetic, and anything that overflows is redone with GMP.
+    // Values are canonical: a value is small exactly when it fits (and reduced, with a positive denominator),
+    // so equal values have equal representations
+    class SmallQ {
+    private:
+        // INT64_MIN is never a small numerator, so negation cannot overflow
+        static constexpr int64_t MIN = -std::numeric_limits<int64_t>::max();
+
+        int64_t num_;
+        int64_t den_;
+        mpq_class* big_; // nullptr if small
+
+        // Takes a canonical mpq_class, and keeps it only if it does not fit
+        void assign(mpq_class&& q);
+
+        // Overflow checked arithmetic on two small values, returns false on overflow
+        bool add_small(const SmallQ& rhs);
+        bool mul_small(const SmallQ& rhs);
+
+    public:
+        SmallQ() : num_(0), den_(1), big_(nullptr) {}
+        SmallQ(const int n) : num_(n), den_(1), big_(nullptr) {}
+        SmallQ(const int64_t n) : num_(n), den_(1), big_(nullptr) { if (n < MIN) assign(mpq_class(mpz_class(n))); }
+        // Throws std::domain_error if den = 0
+        SmallQ(const int64_t num, const int64_t den);
+        SmallQ(const mpq_class& q) : SmallQ() { assign(mpq_class(q)); }
+
+        SmallQ(const SmallQ& other) : num_(other.num_), den_(other.den_), 
+            big_(other.big_ == nullptr ? nullptr : new mpq_class(*other.big_)) {}
+        SmallQ(SmallQ&& other) noexcept : num_(other.num_), den_(other.den_), big_(other.big_) { other.big_ = nullptr; }
+        SmallQ& operator=(const SmallQ& other) { return *this = SmallQ(other); }
+        SmallQ& operator=(SmallQ&& other) noexcept {
+            std::swap(num_, other.num_);
+            std::swap(den_, other.den_);
+            std::swap(big_, other.big_);
+            return *this;
+        }
+        ~SmallQ() { delete big_; }
+
+        bool is_small() const { return big_ == nullptr; }
+        // Only meaningful if small
+        int64_t num() const { return num_; }
+        int64_t den() const { return den_; }
+
+        mpq_class get_mpq() const;
+        double get_d() const { return big_ == nullptr ? double(num_) / double(den_) : big_->get_d(); }
+
+        int sign() const { return big_ == nullptr ? (num_ > 0) - (num_ < 0) : sgn(*big_); }
+
+        SmallQ operator-() const;
+
+        SmallQ& operator+=(const SmallQ& rhs) {
+            if (big_ == nullptr && rhs.big_ == nullptr && add_small(rhs)) return *this;
+            assign(get_mpq() + rhs.get_mpq());
+            return *this;
+        }
+        SmallQ& operator-=(const SmallQ& rhs) { return *this += -rhs; }
+        SmallQ& operator*=(const SmallQ& rhs) {
+            if (big_ == nullptr && rhs.big_ == nullptr && mul_small(rhs)) return *this;
+            assign(get_mpq() * rhs.get_mpq());
+            return *this;
+        }
+        // Throws std::domain_error if rhs = 0
+        SmallQ& operator/=(const SmallQ& rhs);
+
+        friend SmallQ operator+(SmallQ lhs, const SmallQ& rhs) { return lhs += rhs; }
+        friend SmallQ operator-(SmallQ lhs, const SmallQ& rhs) { return lhs -= rhs; }
+        friend SmallQ operator*(SmallQ lhs, const SmallQ& rhs) { return lhs *= rhs; }
+        friend SmallQ operator/(SmallQ lhs, const SmallQ& rhs) { return lhs /= rhs; }
+
+        friend bool operator==(const SmallQ& lhs, const SmallQ& rhs) {
+            if (lhs.big_ == nullptr || rhs.big_ == nullptr) {
+                return lhs.big_ == rhs.big_ && lhs.num_ == rhs.num_ && lhs.den_ == rhs.den_;
+            }
+            return *lhs.big_ == *rhs.big_;
+        }
+        friend bool operator!=(const SmallQ& lhs, const SmallQ& rhs) { return !(lhs == rhs); }
+
+        friend bool operator<(const SmallQ& lhs, const SmallQ& rhs) {
+            int64_t l, r;
+            if (lhs.big_ == nullptr && rhs.big_ == nullptr && !__builtin_mul_overflow(lhs.num_, rhs.den_, &l) 
+                    && !__builtin_mul_overflow(rhs.num_, lhs.den_, &r)) {
+                return l < r;
+            }
+            return lhs.get_mpq() < rhs.get_mpq();
+        }
+        friend bool operator>(const SmallQ& lhs, const SmallQ& rhs) { return rhs < lhs; }
+        friend bool operator<=(const SmallQ& lhs, const SmallQ& rhs) { return !(rhs < lhs); }
+        friend bool operator>=(const SmallQ& lhs, const SmallQ& rhs) { return !(lhs < rhs); }
+
+        friend SmallQ abs(const SmallQ& x) { return x.sign() < 0 ? -x : x; }
+    };
+
+    std::string to_string(const SmallQ& x);
+};
+
+#endif
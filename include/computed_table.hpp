@@ -0,0 +1,118 @@
+// computed_table.hpp
+#ifndef COMPUTED_TABLE_HPP_
+#define COMPUTED_TABLE_HPP_
+
+#include "arena.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace algebra {
+    // Operations whose results are memoized
+    enum CacheOp : uint32_t {
+        NONE = 0,
+        ADD,   // a + b
+        MUL,   // a * b
+        SCALE, // a scaled by the mononode b and the coefficient keyed by scalar
+        SUB,   // a with variable c replaced by b
+        AXPY,  // a - s c b, where c is a mononode and s the coefficient keyed by scalar
+    };
+
+    // Bounded, lossy memo of operation results, like the computed table of a BDD package
+    //
+    // The table is direct mapped: an insertion simply overwrites whatever shared its slot.
+    // Since operands and results are all interned, and coefficients are only keyed by exact encodings,
+    // a hit needs no further verification
+    //
+    // Once concurrent, every entry is read and written under one of STRIPES locks, 
+    // and the counters may miss a few updates
+    class ComputedTable {
+    private:
+        struct Entry {
+            uint32_t op;
+            Id a;
+            Id b;
+            Id c;
+            Id result;
+            uint64_t scalar;
+        };
+
+        static constexpr int STRIPES = 64;
+
+        std::vector<Entry> entries_;
+        int shift_;
+
+        bool concurrent_;
+        mutable std::mutex stripes_[STRIPES];
+
+        // Increments are a plain load and store, not atomic read-modify-writes
+        std::atomic<size_t> hits_;
+        std::atomic<size_t> misses_;
+
+        size_t index(const uint32_t op, const Id a, const Id b, const Id c, const uint64_t scalar) const {
+            uint64_t h = (uint64_t(a) << 32 | b) * 0x9e3779b97f4a7c15;
+            h ^= (uint64_t(c) << 32 | op) * 0xc2b2ae3d27d4eb4f;
+            h ^= (scalar ^ (scalar >> 31)) * 0x94d049bb133111eb;
+            return (h ^ (h >> 29)) * 0x165667b19e3779f9 >> shift_;
+        }
+
+        std::unique_lock<std::mutex> lock(const size_t i) const {
+            return concurrent_ ? std::unique_lock<std::mutex>(stripes_[i % STRIPES]) : std::unique_lock<std::mutex>();
+        }
+
+        static void count(std::atomic<size_t> &counter) {
+            counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+
+    public:
+        // A table of (1 << bits) entries, 0 disables it
+        ComputedTable(const int bits = 0) : concurrent_(false), hits_(0), misses_(0) { resize(bits); }
+
+        void resize(const int bits) {
+            entries_.assign(bits > 0 ? size_t(1) << bits : 0, Entry{NONE, 0, 0, 0, 0, 0});
+            shift_ = 64 - bits;
+        }
+
+        // Not to be called while other threads use the table
+        void set_concurrent(const bool concurrent) { concurrent_ = concurrent; }
+
+        // Returns whether the result is cached, and if so sets result
+        bool find(const uint32_t op, const Id a, const Id b, const Id c, Id &result, const uint64_t scalar = 0) {
+            if (entries_.empty()) return false;
+
+            const size_t i = index(op, a, b, c, scalar);
+            std::unique_lock<std::mutex> guard = lock(i);
+            const Entry &e = entries_[i];
+            if (e.op == op && e.a == a && e.b == b && e.c == c && e.scalar == scalar) {
+                result = e.result;
+                count(hits_);
+                return true;
+            }
+            count(misses_);
+            return false;
+        }
+
+        void insert(const uint32_t op, const Id a, const Id b, const Id c, const Id result, const uint64_t scalar = 0) {
+            if (entries_.empty()) return;
+
+            const size_t i = index(op, a, b, c, scalar);
+            std::unique_lock<std::mutex> guard = lock(i);
+            entries_[i] = Entry{op, a, b, c, result, scalar};
+        }
+
+        // Forgets every result, but keeps the counters
+        void clear() {
+            std::fill(entries_.begin(), entries_.end(), Entry{NONE, 0, 0, 0, 0, 0});
+        }
+
+        size_t capacity() const { return entries_.size(); }
+        size_t hits() const { return hits_.load(std::memory_order_relaxed); }
+        size_t misses() const { return misses_.load(std::memory_order_relaxed); }
+    };
+};
+
+#endif
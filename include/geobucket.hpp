@@ -0,0 +1,60 @@
+// geobucket.hpp
+#ifndef GEOBUCKET_HPP_
+#define GEOBUCKET_HPP_
+
+#include "algebra.hpp"
+
+#include <utility>
+#include <vector>
+
+namespace algebra {
+    // A mutable, uninterned polynomial for long chains of additions, as in reductions
+    //
+    // Terms are spread over buckets of geometrically growing capacity (Yan's geobuckets),
+    // so adding a short polynomial to a long one does not rewrite the long one.
+    // Buckets are sorted with the leading term at the back, and may share mononodes
+    // until they are merged, so only the leading term and normalize() are exact
+    template<class R>
+    class Geobucket {
+    private:
+        typedef std::vector<std::pair<MononodeId, R>> Terms;
+
+        NodeStore<R> &node_store_;
+        std::vector<Terms> buckets_;
+
+        static size_t capacity(const size_t k) { return size_t(4) << (2 * k); }
+
+        // Merges two buckets, combining like terms and dropping zeros
+        Terms merge(Terms&& lhs, Terms&& rhs) const;
+
+        // Adds terms that are sorted with the leading term at the back
+        void add(Terms&& terms);
+
+        // The bucket holding the leading term at its back, after gathering it from the others
+        Terms* lead_bucket();
+
+    public:
+        Geobucket(NodeStore<R> &node_store);
+        Geobucket(NodeStore<R> &node_store, const Polynode<R> &p);
+
+        // The leading term, or nullptr if the polynomial is zero
+        const std::pair<MononodeId, R>* leading();
+
+        // this += c m p
+        void add_scaled(const R &c, const Mononode<R> &m, const Polynode<R> &p);
+
+        // this *= c, for c != 0
+        void scale(const R &c);
+
+        // this += c m p, where the leading terms of this and c m p are known to cancel
+        void cancel_leading(const R &c, const Mononode<R> &m, const Polynode<R> &p);
+
+        // Merges every bucket into one, and returns its terms with the leading term at the back
+        const Terms& normalize();
+
+        // Interns the current value
+        const Polynode<R>* to_polynode();
+    };
+};
+
+#endif
@@ -1,4 +1,9 @@
+// groebner.hpp
+#ifndef GROEBNER_HPP_
+#define GROEBNER_HPP_
+
 #include "algebra.hpp"
+#include "geobucket.hpp"
 
 #include <gmpxx.h>
 #include <chrono>
@@ -25,6 +30,19 @@ private:
 
     algebra::NodeStore<R> &node_store_;
 
+    // Collect garbage between iterations once the store holds more polynodes than this
+    size_t gc_threshold_;
+
+    // Keep polynomials primitive (integral, with coprime coefficients) and cross multiply, 
+    // instead of making them monic and dividing
+    bool fraction_free_;
+
+    // Reduce batches of pairs as Macaulay matrices (F4) instead of one S polynomial at a time
+    bool f4_;
+
+    // Divides by the gcd of the coefficients
+    void make_primitive(algebra::Geobucket<R> &p);
+
     Poly<R>* S_poly(Poly<R>* p1, Poly<R>* p2);
     
     // Lead reduce p wrt the basis [*b_start, *b_end)
@@ -34,9 +52,23 @@ private:
     Poly<R>* reduce(Poly<R>* p, const PolyIter<R> &b_start, const PolyIter<R> &b_end, 
                                 const PolyIter<R> &b_start2, const PolyIter<R> &b_end2);
 
+    // Keeps polys_ and mononode_roots, once the store has grown past gc_threshold_
+    void collect_garbage(const std::vector<algebra::MononodeId> &mononode_roots);
+
+    // Buchberger's algorithm
     bool calculate_gbasis();
+
+    // Faugere's F4: all pairs of the smallest lcm degree at once, 
+    // reduced together by sparse Gaussian elimination on their Macaulay matrix
+    bool calculate_gbasis_f4();
 public:
-    Reducer(std::vector<Poly<R>*> polys, algebra::NodeStore<R> &node_store);
+    static constexpr size_t DEFAULT_GC_THRESHOLD = 1 << 13;
+
+    // Only the polynodes in the basis survive garbage collection: 
+    // pin anything else that must outlive the reduction
+    // Both engines give the same reduced basis
+    Reducer(std::vector<Poly<R>*> polys, algebra::NodeStore<R> &node_store, 
+            size_t gc_threshold = DEFAULT_GC_THRESHOLD, bool fraction_free = false, bool f4 = false);
 
     // Calculate a reduced Groebner basis, and override the current polynomials
     //
@@ -49,5 +81,14 @@ public:
     bool calculate_reduced_gbasis(int max_duration_ms = -1);
     
     std::vector<Poly<R>*> get_polys() const;
+
+    // Divides by the gcd of the coefficients, which over Q leaves them integral and coprime
+    Poly<R>* make_primitive(Poly<R>* p);
+
+    // Whether the current polynomials are a Groebner basis of an ideal containing polys, 
+    // that is every S polynomial and every element of polys lead reduces to 0
+    bool verify(const std::vector<Poly<R>*> &polys);
 };
 };
+
+#endif
@@ -1,8 +1,15 @@
 #include "algebra.hpp"
+#include "coeff.hpp"
 
 #include <gmpxx.h>
 
 namespace Input {
+enum COEFF_TYPE {
+    rational, // Exact, over Q
+    mod_p,    // Over Z/pZ, much faster but only correct with high probability
+    small_rational, // Exact, over Q, with machine word fractions until they overflow
+};
+
 struct Arg {
     bool groebner = true; // Calculate Groebner basis?
     bool pretty = true; // Pretty print?
@@ -12,6 +19,17 @@ struct Arg {
                       // 1 = reorder variables
                       // 2 = 1 and plug in 0s
     int simplify_timeout = 60000; // Number of milliseconds to spend simplifying
+    int cache_bits = algebra::NodeStore<mpq_class>::DEFAULT_CACHE_BITS; // log2 of the computed table size, 0 = off
+    bool stats = false; // Print cache statistics to err?
+    size_t gc_threshold = 1 << 13; // Number of polynodes before garbage is collected in the Groebner basis loop
+    COEFF_TYPE coeff = rational; // Field of the coefficients
+    uint32_t prime = coeff::ModP::DEFAULT_PRIME; // The prime if coeff = mod_p
+    bool modular = false; // Over Q, lift the Groebner basis from its images mod several primes?
+    bool fraction_free = false; // Over Q, keep the polynomials primitive instead of monic while reducing?
+    bool f4 = false; // Reduce the pairs in batches, as Macaulay matrices (F4), instead of one at a time?
+    unsigned threads = 0; // Worker threads for substituting into the hypotheses and for the primes of modular,
+                          // the output does not depend on it. 0 = not given: substitutions run on one thread,
+                          // and modular on every hardware thread
 };
 
 enum CMD_TYPE {
@@ -0,0 +1,220 @@
+// intern.hpp
+#ifndef INTERN_HPP_
+#define INTERN_HPP_
+
+#include "arena.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace algebra {
+    // Open addressing (Robin Hood) index from hashes to arena ids
+    //
+    // The table never sees the objects themselves: callers pass the hash of their key
+    // together with an equality test on candidate ids, and a factory that is only
+    // invoked when the key is missing. A lookup or insertion is a single probe sequence.
+    //
+    // Each slot is 8 bytes: the id, and a 32-bit tag packing a 24-bit fingerprint of the
+    // hash with the probe distance. Fingerprints only filter candidates, every match is
+    // confirmed by the equality test, so colliding keys are never merged.
+    //
+    // The full hash is never stored, callers provide HashOf: uint64_t(Id) to recover it
+    // when the table grows (or, in degenerate cases, when a distance does not fit in 8 bits)
+    class InternTable {
+    private:
+        struct Slot {
+            uint32_t tag; // Fingerprint in the high 24 bits, 1 + distance from home in the low 8, 0 if empty
+            Id id;
+        };
+
+        static constexpr uint32_t DIST_MASK = 0xff;
+        static constexpr int MIN_BITS = 4;
+
+        std::vector<Slot> slots_;
+        size_t size_;
+        int shift_;
+
+        size_t home(const uint64_t hash) const {
+            return (hash * 0x9e3779b97f4a7c15) >> shift_;
+        }
+
+        static uint32_t fingerprint(const uint64_t hash) {
+            return uint32_t(hash) & ~DIST_MASK;
+        }
+
+        static uint32_t make_tag(const uint32_t fp, const uint32_t dist) {
+            return fp | std::min(dist, DIST_MASK);
+        }
+
+        size_t mask() const { return slots_.size() - 1; }
+
+        // 1 + distance of slot i from its home, 0 if empty
+        template<class HashOf>
+        uint32_t dist_at(const size_t i, HashOf&& hash_of) const {
+            const uint32_t dist = slots_[i].tag & DIST_MASK;
+            if (dist < DIST_MASK) return dist;
+            return ((i - home(hash_of(slots_[i].id))) & mask()) + 1;
+        }
+
+        // Robin Hood insertion of an entry known to be missing, starting at slot i
+        template<class HashOf>
+        void place(uint32_t fp, Id id, uint32_t dist, size_t i, HashOf&& hash_of) {
+            for (;; i = (i + 1) & mask(), dist++) {
+                const uint32_t cur_dist = dist_at(i, hash_of);
+                if (cur_dist == 0) {
+                    slots_[i] = Slot{make_tag(fp, dist), id};
+                    return;
+                }
+                if (cur_dist < dist) {
+                    Slot displaced = slots_[i];
+                    slots_[i] = Slot{make_tag(fp, dist), id};
+
+                    fp = displaced.tag & ~DIST_MASK;
+                    id = displaced.id;
+                    dist = cur_dist;
+                }
+            }
+        }
+
+        template<class HashOf>
+        void grow(HashOf&& hash_of) {
+            std::vector<Slot> old(slots_.size() * 2, Slot{0, 0});
+            old.swap(slots_);
+            shift_--;
+
+            for (const Slot &s : old) {
+                if (s.tag == 0) continue;
+                const uint64_t hash = hash_of(s.id);
+                place(fingerprint(hash), s.id, 1, home(hash), hash_of);
+            }
+        }
+
+    public:
+        InternTable() : slots_(size_t(1) << MIN_BITS, Slot{0, 0}), size_(0), shift_(64 - MIN_BITS) {}
+
+        // Eq: bool(Id), whether the object with this id has the requested key
+        // Returns a pointer to the id, or nullptr if missing
+        template<class Eq, class HashOf>
+        const Id* find(const uint64_t hash, Eq&& eq, HashOf&& hash_of) const {
+            const uint32_t fp = fingerprint(hash);
+            size_t i = home(hash);
+            for (uint32_t dist = 1;; i = (i + 1) & mask(), dist++) {
+                const Slot &cur = slots_[i];
+                if (dist_at(i, hash_of) < dist) return nullptr;
+                if ((cur.tag & ~DIST_MASK) == fp && eq(cur.id)) return &cur.id;
+            }
+        }
+
+        // Make: Id(), creates the object and returns its id
+        // Returns the id, and whether it was newly created
+        template<class Eq, class Make, class HashOf>
+        std::pair<Id, bool> find_or_emplace(const uint64_t hash, Eq&& eq, Make&& make, HashOf&& hash_of) {
+            // Keep the load factor below 7/8
+            if ((size_ + 1) * 8 > slots_.size() * 7) grow(hash_of);
+
+            const uint32_t fp = fingerprint(hash);
+            size_t i = home(hash);
+            for (uint32_t dist = 1;; i = (i + 1) & mask(), dist++) {
+                const Slot &cur = slots_[i];
+                if (dist_at(i, hash_of) < dist) {
+                    // Every entry from here on is closer to home than we would be, so the key is missing
+                    const Id id = make();
+                    place(fp, id, dist, i, hash_of);
+                    size_++;
+                    return {id, true};
+                }
+                if ((cur.tag & ~DIST_MASK) == fp && eq(cur.id)) return {cur.id, false};
+            }
+        }
+
+        // Adds an id whose key is known to be missing
+        template<class HashOf>
+        void insert(const uint64_t hash, const Id id, HashOf&& hash_of) {
+            if ((size_ + 1) * 8 > slots_.size() * 7) grow(hash_of);
+            place(fingerprint(hash), id, 1, home(hash), hash_of);
+            size_++;
+        }
+
+        size_t size() const { return size_; }
+
+        void clear() {
+            std::fill(slots_.begin(), slots_.end(), Slot{0, 0});
+            size_ = 0;
+        }
+    };
+
+    // InternTable split by the low bits of the hash into independent shards, each behind its own lock
+    //
+    // The locks are only taken once the table is concurrent, so a single thread pays nothing for them.
+    // Make runs under the lock of its shard, so an object is created exactly once
+    // even when several threads ask for it at the same time
+    class ShardedInternTable {
+    private:
+        static constexpr int SHARD_BITS = 4;
+
+        // A cache line each, so that neighbouring locks do not share one
+        struct alignas(64) Shard {
+            InternTable table;
+            mutable std::mutex mutex;
+        };
+
+        Shard shards_[1 << SHARD_BITS];
+        bool concurrent_;
+
+        Shard& shard(const uint64_t hash) { return shards_[hash & ((1 << SHARD_BITS) - 1)]; }
+        const Shard& shard(const uint64_t hash) const { return shards_[hash & ((1 << SHARD_BITS) - 1)]; }
+
+        std::unique_lock<std::mutex> lock(const Shard& s) const {
+            return concurrent_ ? std::unique_lock<std::mutex>(s.mutex) : std::unique_lock<std::mutex>();
+        }
+
+    public:
+        ShardedInternTable() : concurrent_(false) {}
+
+        // Not to be called while other threads use the table
+        void set_concurrent(const bool concurrent) { concurrent_ = concurrent; }
+
+        // Same as InternTable::find, but copies the id out while the shard is locked
+        // Returns whether it was found
+        template<class Eq, class HashOf>
+        bool find(const uint64_t hash, Eq&& eq, HashOf&& hash_of, Id &id) const {
+            const Shard &s = shard(hash);
+            std::unique_lock<std::mutex> guard = lock(s);
+            const Id* found = s.table.find(hash, std::forward<Eq>(eq), std::forward<HashOf>(hash_of));
+            if (found != nullptr) id = *found;
+            return found != nullptr;
+        }
+
+        template<class Eq, class Make, class HashOf>
+        std::pair<Id, bool> find_or_emplace(const uint64_t hash, Eq&& eq, Make&& make, HashOf&& hash_of) {
+            Shard &s = shard(hash);
+            std::unique_lock<std::mutex> guard = lock(s);
+            return s.table.find_or_emplace(hash, std::forward<Eq>(eq), std::forward<Make>(make), 
+                    std::forward<HashOf>(hash_of));
+        }
+
+        template<class HashOf>
+        void insert(const uint64_t hash, const Id id, HashOf&& hash_of) {
+            Shard &s = shard(hash);
+            std::unique_lock<std::mutex> guard = lock(s);
+            s.table.insert(hash, id, std::forward<HashOf>(hash_of));
+        }
+
+        // Not synchronized
+        size_t size() const {
+            size_t res = 0;
+            for (const Shard &s : shards_) res += s.table.size();
+            return res;
+        }
+
+        void clear() {
+            for (Shard &s : shards_) s.table.clear();
+        }
+    };
+};
+
+#endif
@@ -0,0 +1,36 @@
+// kernels.hpp
+#ifndef KERNELS_HPP_
+#define KERNELS_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace coeff {
+    // Row operations mod a prime p < 2^31, for the linear algebra of the F4 engine
+    //
+    // Rows are reduced in 64-bit accumulators, and reduced mod p only when an entry is read.
+    // A product of two residues is below 2^62, so an accumulator stays below 2^63 by subtracting
+    // fold = the largest multiple of p^2 below 2^63 whenever the top bit gets set.
+    // Every function takes the value mod p of the accumulator to be unchanged by that
+    enum class Isa {
+        scalar,
+        sse2,
+        avx2,
+    };
+
+    // The widest instruction set the CPU supports, detected at run time
+    Isa detect_isa();
+    const char* isa_name(const Isa isa);
+
+    uint64_t fold_constant(const uint32_t p);
+
+    // acc[i] += f * vals[i] for i < n
+    void axpy_dense(uint64_t* acc, const uint32_t* vals, const size_t n, const uint32_t f, 
+            const uint64_t fold, const Isa isa);
+
+    // acc[cols[i]] += f * vals[i] for i < n, scalar since there is no scatter before AVX-512
+    void axpy_sparse(uint64_t* acc, const uint32_t* cols, const uint32_t* vals, const size_t n, const uint32_t f,
+            const uint64_t fold);
+};
+
+#endif
@@ -0,0 +1,65 @@
+// modular.hpp
+#ifndef MODULAR_HPP_
+#define MODULAR_HPP_
+
+#include "algebra.hpp"
+#include "coeff.hpp"
+#include "groebner.hpp"
+
+#include <gmpxx.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace groebner {
+// Reduced Groebner basis over Q through its images mod word sized primes
+//
+// Batches of primes run Reducer<coeff::ModP> in parallel, each thread with its own NodeStore.
+// The bases whose leading monomials agree with the majority are combined by Chinese remaindering,
+// and lifted back to Q by rational reconstruction.
+// The lift is only accepted once it verifies over Q against the input,
+// and after MAX_PRIMES primes (or a timed out prime) the basis is computed over Q instead
+class ModularReducer {
+private:
+    std::vector<Poly<mpq_class>*> input_;
+    std::vector<Poly<mpq_class>*> polys_;
+
+    algebra::NodeStore<mpq_class> &node_store_;
+
+    size_t gc_threshold_;
+    int cache_bits_;
+    unsigned threads_;
+    bool fraction_free_;
+    bool f4_;
+
+    // Number of primes that were tried, lucky or not
+    size_t primes_used_;
+
+    // Falls back to Reducer<mpq_class>, with the same fraction_free and f4
+    bool calculate_over_q(int max_duration_ms);
+public:
+    static constexpr size_t MAX_PRIMES = 64;
+
+    // threads = 0 picks the number of hardware threads
+    // f4 picks the engine of the images and of the fallback, fraction_free only matters for the fallback
+    ModularReducer(std::vector<Poly<mpq_class>*> polys, algebra::NodeStore<mpq_class> &node_store,
+            size_t gc_threshold = Reducer<mpq_class>::DEFAULT_GC_THRESHOLD,
+            int cache_bits = algebra::NodeStore<mpq_class>::DEFAULT_CACHE_BITS, unsigned threads = 0,
+            bool fraction_free = false, bool f4 = false);
+
+    // Same contract as Reducer::calculate_reduced_gbasis
+    bool calculate_reduced_gbasis(int max_duration_ms = -1);
+
+    std::vector<Poly<mpq_class>*> get_polys() const;
+
+    size_t get_primes_used() const;
+};
+
+// The n primes below 2^31 under (and excluding) below, in decreasing order
+std::vector<uint32_t> primes_below(uint32_t below, size_t n);
+
+// Finds the fraction num / den = a mod m with |num|, den <= sqrt(m / 2), if there is one
+bool rational_reconstruction(const mpz_class &a, const mpz_class &m, mpq_class &res);
+};
+
+#endif
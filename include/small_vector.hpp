@@ -0,0 +1,105 @@
+// small_vector.hpp
+#ifndef SMALL_VECTOR_HPP_
+#define SMALL_VECTOR_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace algebra {
+    // Contiguous storage holding up to N elements inline, and spilling to the heap beyond that
+    //
+    // Only meant for small, trivially copyable elements, so growth and copies are memcpy
+    template<class T, unsigned N>
+    class SmallVector {
+        static_assert(std::is_trivially_copyable<T>::value, "SmallVector elements must be trivially copyable");
+    private:
+        T* data_;
+        uint32_t size_;
+        uint32_t capacity_;
+        T inline_[N];
+
+        bool is_inline() const { return data_ == inline_; }
+
+        void grow(const size_t capacity) {
+            T* data = static_cast<T*>(::operator new(capacity * sizeof(T)));
+            std::memcpy(static_cast<void*>(data), data_, size_ * sizeof(T));
+            if (!is_inline()) ::operator delete(data_);
+            data_ = data;
+            capacity_ = uint32_t(capacity);
+        }
+
+    public:
+        typedef T value_type;
+        typedef T* iterator;
+        typedef const T* const_iterator;
+
+        SmallVector() : data_(inline_), size_(0), capacity_(N) {}
+
+        SmallVector(const SmallVector& other) : SmallVector() {
+            reserve(other.size_);
+            std::memcpy(static_cast<void*>(data_), other.data_, other.size_ * sizeof(T));
+            size_ = other.size_;
+        }
+
+        SmallVector(SmallVector&& other) noexcept : SmallVector() {
+            if (other.is_inline()) {
+                std::memcpy(static_cast<void*>(data_), other.data_, other.size_ * sizeof(T));
+            } else {
+                data_ = other.data_;
+                capacity_ = other.capacity_;
+                other.data_ = other.inline_;
+                other.capacity_ = N;
+            }
+            size_ = other.size_;
+            other.size_ = 0;
+        }
+
+        SmallVector& operator=(SmallVector other) noexcept {
+            this->~SmallVector();
+            new (this) SmallVector(std::move(other));
+            return *this;
+        }
+
+        ~SmallVector() {
+            if (!is_inline()) ::operator delete(data_);
+        }
+
+        void reserve(const size_t capacity) {
+            if (capacity > capacity_) grow(capacity);
+        }
+
+        void push_back(const T& value) {
+            if (size_ == capacity_) grow(size_t(capacity_) * 2);
+            data_[size_++] = value;
+        }
+
+        void pop_back() { size_--; }
+        void clear() { size_ = 0; }
+
+        size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+
+        T& operator[](const size_t i) { return data_[i]; }
+        const T& operator[](const size_t i) const { return data_[i]; }
+
+        T& back() { return data_[size_ - 1]; }
+        const T& back() const { return data_[size_ - 1]; }
+
+        iterator begin() { return data_; }
+        iterator end() { return data_ + size_; }
+        const_iterator begin() const { return data_; }
+        const_iterator end() const { return data_ + size_; }
+
+        bool operator==(const SmallVector& other) const {
+            return size_ == other.size_ && std::equal(begin(), end(), other.begin());
+        }
+        bool operator!=(const SmallVector& other) const { return !(*this == other); }
+    };
+};
+
+#endif
@@ -0,0 +1,69 @@
+// substitute.hpp
+#ifndef SUBSTITUTE_HPP_
+#define SUBSTITUTE_HPP_
+
+#include "algebra.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace algebra {
+    // Substitutes polynodes for variables, everywhere including inside f(polynode)s
+    //
+    // Every node, polynode and power of a substituted node is rewritten once per Substituter,
+    // however often it is shared in the DAG, and across every polynode it is applied to.
+    // The memo holds ids, so the store must not collect garbage while a Substituter is in use
+    template<class R>
+    class Substituter {
+    private:
+        // What a node becomes: itself, another node, zero, or a general polynode
+        struct Image {
+            NodeId node; // Valid if poly == nullptr and !zero
+            bool zero;
+            const Polynode<R>* poly;
+        };
+
+        NodeStore<R> &node_store_;
+        std::unordered_map<Idx, const Polynode<R>*> replace_;
+        // Polynodes without any of these are left as they are
+        VarSet replaced_;
+
+        std::unordered_map<NodeId, Image> nodes_;
+        std::unordered_map<PolynodeId, PolynodeId> polynodes_;
+        // Keyed by node id << 32 | exponent
+        std::unordered_map<uint64_t, PolynodeId> powers_;
+
+        Image node(const Node<R>& n);
+        const Polynode<R>* power(const Node<R>& n, const int exp);
+
+    public:
+        // Replaces every variable var in replace by replace[var]
+        Substituter(NodeStore<R> &node_store, std::unordered_map<Idx, const Polynode<R>*> replace);
+
+        const Polynode<R>* apply(const Polynode<R>& p);
+        std::vector<const Polynode<R>*> apply(const std::vector<const Polynode<R>*> &ps);
+    };
+
+    // Sets every subset of a set of variables to zero, one variable at a time
+    //
+    // The result for a subset S is derived from S minus its smallest variable, and every variable
+    // has one Substituter shared by all subsets and polynodes, so a DAG is walked once per variable.
+    // Same restriction on garbage collection as Substituter
+    template<class R>
+    class ZeroSubstituter {
+    private:
+        NodeStore<R> &node_store_;
+        std::unordered_map<Idx, Substituter<R>> zeros_;
+
+        Substituter<R>& zero(const Idx var);
+
+    public:
+        ZeroSubstituter(NodeStore<R> &node_store);
+
+        // Returns p with vars[i] = 0 for the bits i of mask, for every mask in [0, 2^|vars|)
+        std::vector<const Polynode<R>*> subsets(const Polynode<R>& p, const std::vector<Idx> &vars);
+    };
+};
+
+#endif
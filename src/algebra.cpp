@@ -1,11 +1,12 @@
 #include "../include/algebra.hpp"
+#include "../include/coeff.hpp"
+#include "../include/substitute.hpp"
 
 #include <algorithm>
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <numeric>
-#include <map>
 
 #include <gmpxx.h>
 
@@ -34,17 +35,66 @@ uint64_t fast_hash(uint64_t conj, uint64_t n) {
     return x ^ conj;
 }
 
+// All hashes are evaluations at a random point modulo the Mersenne prime 2^61 - 1:
+//  - a node hashes to a random nonzero residue (its value),
+//  - a mononode hashes to the product of its nodes' values,
+//  - a polynode hashes to the sum of its coefficients times its mononodes' hashes
+// This makes the hash of a product, quotient, sum, negation or scaling a function 
+// of the hashes of the operands, so results can be looked up before they are built
+constexpr uint64_t HASH_P = (uint64_t(1) << 61) - 1;
+
+inline uint64_t mod_p(const uint64_t x) {
+    uint64_t y = (x & HASH_P) + (x >> 61);
+    return y >= HASH_P ? y - HASH_P : y;
+}
+
+inline uint64_t add_p(const uint64_t a, const uint64_t b) { return mod_p(a + b); }
+
+inline uint64_t neg_p(const uint64_t a) { return a == 0 ? 0 : HASH_P - a; }
+
+inline uint64_t mul_p(const uint64_t a, const uint64_t b) {
+    __uint128_t prod = __uint128_t(a) * b;
+    return mod_p((uint64_t(prod) & HASH_P) + uint64_t(prod >> 61));
+}
+
+inline uint64_t pow_p(uint64_t a, uint64_t e) {
+    uint64_t res = 1;
+    for (; e; e >>= 1, a = mul_p(a, a)) {
+        if (e & 1) res = mul_p(res, a);
+    }
+    return res;
+}
+
+inline uint64_t inv_p(const uint64_t a) { return pow_p(a, HASH_P - 2); }
+
+// A random nonzero residue, to be used as the value of a node
+inline uint64_t unit_p(const uint64_t x) {
+    uint64_t y = mod_p(x);
+    return y == 0 ? 1 : y;
+}
+
+/*
+ * Var Set
+ */
+std::vector<algebra::Idx> algebra::VarSet::to_vector() const {
+    std::vector<Idx> res;
+    for (uint64_t rest = bits; rest != 0; rest &= rest - 1) res.push_back(Idx(__builtin_ctzll(rest)));
+    return res;
+}
+
 /*
  * Node Stats
  */
-algebra::NodeStats::NodeStats(const int weight, const int nested_weight, const int depth, const int length_approx) 
-    : weight(weight), nested_weight(nested_weight), depth(depth), length_approx(length_approx) {}
+algebra::NodeStats::NodeStats(const int weight, const int nested_weight, const int depth, const int length_approx,
+        const VarSet vars) 
+    : weight(weight), nested_weight(nested_weight), depth(depth), length_approx(length_approx), vars(vars) {}
 
 algebra::NodeStats& algebra::NodeStats::add_node(const NodeStats& rhs, int exp) {
     weight += rhs.weight * exp;
     nested_weight += rhs.nested_weight * exp;
     depth = std::max(depth, rhs.depth);
     length_approx += rhs.length_approx * exp;
+    vars |= rhs.vars;
 
     return *this;
 }
@@ -53,6 +103,7 @@ algebra::NodeStats& algebra::NodeStats::add_mononode(const NodeStats& rhs, bool
     nested_weight += rhs.nested_weight;
     depth = std::max(depth, rhs.depth);
     length_approx += rhs.length_approx + !is_one + 1; // for the operator
+    vars |= rhs.vars;
 
     return *this;
 }
@@ -66,7 +117,8 @@ inline algebra::NodeStats from_polynode_stats(const algebra::NodeStats& stats) {
         stats.weight * stats.weight, 
         stats.weight, 
         stats.depth + 1, 
-        stats.length_approx + 3 // for 'f(' and ')'
+        stats.length_approx + 3, // for 'f(' and ')'
+        stats.vars
     );
 }
 
@@ -80,24 +132,29 @@ algebra::NodeBase<Hash>::NodeBase(const Hash hash, const NodeStats node_stats)
 
 template<class Hash>
 bool algebra::NodeBase<Hash>::operator==(const NodeBase<Hash>& rhs) const
-    { return hash == rhs.hash; }
+    { return id == rhs.id; }
 
 template<class Hash>
 bool algebra::NodeBase<Hash>::operator!=(const NodeBase<Hash>& rhs) const
-    { return hash != rhs.hash; }
+    { return id != rhs.id; }
 
 /*
  * NodeStore
  */
 
-// All of this probably uses 2x as many 
-// unordered_map queries as necessary, but i think 
-// that's ok (probably not too bad)
-//
-// TODO: Am i using rvalue references right?
+template<class R>
+algebra::NodeStore<R>::NodeStore(const size_t seed, const int cache_bits) : 
+    concurrent_(false), seed_(seed), conj_((seed ^ 0xab50cbf18725d1d1) * 0x80be920c700dedc1), computed_(cache_bits) {
+    init_constants();
+}
 
+// The constants are interned first, so they always get the same ids
 template<class R>
-algebra::NodeStore<R>::NodeStore(const size_t seed) : conj_((seed ^ 0xab50cbf18725d1d1) * 0x80be920c700dedc1) {}
+void algebra::NodeStore<R>::init_constants() {
+    one_m_ = mononode({})->id;
+    zero_p_ = polynode({})->id;
+    one_p_ = polynode({{one_m_, 1}})->id;
+}
 
 template<class R>
 size_t algebra::NodeStore<R>::hash(const size_t n) const {
@@ -105,142 +162,343 @@ size_t algebra::NodeStore<R>::hash(const size_t n) const {
 }
 
 template<class R>
-const algebra::Node<R>* algebra::NodeStore<R>::get_node(const NodeHash hash) const {
-    auto it = nodes_.find(hash);
-    if (it == nodes_.end()) return nullptr;
-    return &it->second;
+size_t algebra::NodeStore<R>::get_seed() const {
+    return seed_;
+}
+
+template<class R>
+const algebra::Node<R>* algebra::NodeStore<R>::get_node(const NodeId id) const {
+    return &nodes_[id];
+}
+
+template<class R>
+const algebra::Mononode<R>* algebra::NodeStore<R>::get_mononode(const MononodeId id) const {
+    return &mononodes_[id];
 }
 
 template<class R>
-const algebra::Mononode<R>* algebra::NodeStore<R>::get_mononode(const MononodeHash hash) const {
-    auto it = mononodes_.find(hash);
-    if (it == mononodes_.end()) return nullptr;
-    return &it->second;
+const algebra::Polynode<R>* algebra::NodeStore<R>::get_polynode(const PolynodeId id) const {
+    return &polynodes_[id];
 }
 
 template<class R>
-const algebra::Polynode<R>* algebra::NodeStore<R>::get_polynode(const PolynodeHash hash) const {
-    auto it = polynodes_.find(hash);
-    if (it == polynodes_.end()) return nullptr;
-    return &it->second;
+template<class Eq>
+const algebra::Mononode<R>* algebra::NodeStore<R>::find_mononode(const MononodeHash hash, Eq&& eq) const {
+    MononodeId id;
+    const bool found = mononode_ids_.find(hash, 
+            [this, &eq](const MononodeId id) { return eq(mononodes_[id]); },
+            [this](const MononodeId id) { return mononodes_[id].hash; }, id);
+    return found ? &mononodes_[id] : nullptr;
 }
 
 template<class R>
-const algebra::Node<R>* algebra::NodeStore<R>::node(const PolynodeHash pol) {
-    Node<R> node(pol, *this);
-    return insert_node(std::move(node));
+template<class Eq>
+const algebra::Polynode<R>* algebra::NodeStore<R>::find_polynode(const PolynodeHash hash, Eq&& eq) const {
+    PolynodeId id;
+    const bool found = polynode_ids_.find(hash, 
+            [this, &eq](const PolynodeId id) { return eq(polynodes_[id]); },
+            [this](const PolynodeId id) { return polynodes_[id].hash; }, id);
+    return found ? &polynodes_[id] : nullptr;
+}
+
+// Every hit in the intern tables is verified against the key,
+// so distinct objects with colliding hashes are kept apart
+
+template<class R>
+const algebra::Node<R>* algebra::NodeStore<R>::node(const PolynodeId pol) {
+    const NodeHash h = unit_p(hash(get_polynode(pol)->hash));
+    const NodeId id = node_ids_.find_or_emplace(h, 
+            [this, pol](const NodeId id) { return nodes_[id].type_ == NodeType::POL && nodes_[id].pol_ == pol; },
+            [this, pol, h]() {
+                Node<R> n(pol, h, *this);
+                const NodeId id = emplace(nodes_, nodes_mutex_, std::move(n));
+                nodes_[id].id = id;
+                nodes_[id].order_key_ = claim_node_key(nodes_[id].order_key_);
+                return id;
+            },
+            [this](const NodeId id) { return nodes_[id].hash; }).first;
+    return &nodes_[id];
 }
 
 template<class R>
 const algebra::Node<R>* algebra::NodeStore<R>::node(const Idx var) {
-    Node<R> node(var, *this);
-    return insert_node(std::move(node));
+    const NodeHash h = unit_p(hash(var));
+    const NodeId id = node_ids_.find_or_emplace(h, 
+            [this, var](const NodeId id) { return nodes_[id].type_ == NodeType::VAR && nodes_[id].var_ == var; },
+            [this, var, h]() {
+                Node<R> n(var, h, *this);
+                const NodeId id = emplace(nodes_, nodes_mutex_, std::move(n));
+                nodes_[id].id = id;
+                nodes_[id].order_key_ = claim_node_key(nodes_[id].order_key_);
+                if (var >= 0 && var < PackedExps::LANES) var_nodes_[var] = id;
+                return id;
+            },
+            [this](const NodeId id) { return nodes_[id].hash; }).first;
+    return &nodes_[id];
 }
 
 template<class R>
-const algebra::Mononode<R>* algebra::NodeStore<R>::mononode(const std::unordered_map<NodeHash, int>& factors) {
-    Mononode<R> mononode(factors, *this);
-    return insert_mononode(std::move(mononode));
+uint64_t algebra::NodeStore<R>::claim_node_key(uint64_t key) {
+    // Collisions are rare: only f(polynode)s of the same weight, with 30 equal bits of hash
+    std::unique_lock<std::mutex> guard = lock(node_keys_mutex_);
+    while (!node_keys_.insert(key).second) key++;
+    return key;
 }
 
 template<class R>
-const algebra::Polynode<R>* algebra::NodeStore<R>::polynode(const std::vector<std::pair<MononodeHash, R>>& summands) {
-    Polynode<R> polynode(summands, *this);
+const algebra::Mononode<R>* algebra::NodeStore<R>::mononode(const std::unordered_map<NodeId, int>& factors) {
+    FactorVec clean = Mononode<R>::clean_factors(factors, *this);
+    const MononodeHash h = Mononode<R>::hash_factors(clean, *this);
+    return intern_mononode(std::move(clean), h);
+}
 
-    return insert_polynode(std::move(polynode));
+template<class R>
+const algebra::Polynode<R>* algebra::NodeStore<R>::polynode(const std::vector<std::pair<MononodeId, R>>& summands) {
+    return intern_polynode(Polynode<R>::clean_summands(summands, *this));
+}
+
+template<class R>
+const algebra::Mononode<R>* algebra::NodeStore<R>::intern_mononode(FactorVec&& factors, const MononodeHash h) {
+    const MononodeId id = mononode_ids_.find_or_emplace(h, 
+            [this, &factors](const MononodeId id) { return mononodes_[id].factors_ == factors; },
+            [this, &factors, h]() {
+                Mononode<R> m(std::move(factors), h, *this);
+                const MononodeId id = emplace(mononodes_, mononodes_mutex_, std::move(m));
+                mononodes_[id].id = id;
+                return id;
+            },
+            [this](const MononodeId id) { return mononodes_[id].hash; }).first;
+    return &mononodes_[id];
+}
+
+template<class R>
+const algebra::Polynode<R>* algebra::NodeStore<R>::intern_polynode(std::vector<std::pair<MononodeId, R>>&& summands) {
+    bool homomorphic;
+    const PolynodeHash h = Polynode<R>::hash_summands(summands, *this, homomorphic);
+    return intern_polynode(std::move(summands), h, homomorphic);
+}
+
+template<class R>
+const algebra::Polynode<R>* algebra::NodeStore<R>::intern_polynode(std::vector<std::pair<MononodeId, R>>&& summands,
+        const PolynodeHash h, const bool homomorphic) {
+    const PolynodeId id = polynode_ids_.find_or_emplace(h, 
+            [this, &summands](const PolynodeId id) { return polynodes_[id].summands_ == summands; },
+            [this, &summands, h, homomorphic]() {
+                Polynode<R> p(std::move(summands), h, homomorphic, *this);
+                const PolynodeId id = emplace(polynodes_, polynodes_mutex_, std::move(p));
+                polynodes_[id].id = id;
+                return id;
+            },
+            [this](const PolynodeId id) { return polynodes_[id].hash; }).first;
+    return &polynodes_[id];
 }
 
 template<class R>
 const algebra::Mononode<R>* algebra::NodeStore<R>::one_m() {
-    return mononode({});
+    return &mononodes_[one_m_];
 }
 
 template<class R>
 const algebra::Polynode<R>* algebra::NodeStore<R>::zero_p() {
-    return polynode({});
+    return &polynodes_[zero_p_];
 }
 
 template<class R>
 const algebra::Polynode<R>* algebra::NodeStore<R>::one_p() {
-    return polynode({{one_m()->hash, 1}});
+    return &polynodes_[one_p_];
 }
 
 template<class R>
-const algebra::Node<R>* algebra::NodeStore<R>::insert_node(Node<R>&& node) {
-    NodeHash hash = node.hash;
+void algebra::NodeStore<R>::pin(const Polynode<R>* p) {
+    pinned_[p->id]++;
+}
 
-    // Does not already exist
-    if (nodes_.find(hash) == nodes_.end()) {
-        nodes_.insert({ hash, std::move(node) });
-    }
-    return &nodes_.at(hash);
+template<class R>
+void algebra::NodeStore<R>::unpin(const Polynode<R>* p) {
+    auto it = pinned_.find(p->id);
+    if (--it->second == 0) pinned_.erase(it);
 }
 
 template<class R>
-const algebra::Mononode<R>* algebra::NodeStore<R>::insert_mononode(Mononode<R>&& mononode) {
-    MononodeHash hash = mononode.hash;
+size_t algebra::NodeStore<R>::collect(const std::vector<PolynodeId> &roots, 
+        const std::vector<MononodeId> &mononode_roots) {
+    std::vector<bool> node_live(nodes_.size()), mononode_live(mononodes_.size()), polynode_live(polynodes_.size());
+    std::vector<PolynodeId> polynode_stack;
+    std::vector<MononodeId> mononode_stack;
+
+    auto mark_polynode = [&polynode_live, &polynode_stack](const PolynodeId p) {
+        if (!polynode_live[p]) {
+            polynode_live[p] = true;
+            polynode_stack.push_back(p);
+        }
+    };
+    auto mark_mononode = [&mononode_live, &mononode_stack](const MononodeId m) {
+        if (!mononode_live[m]) {
+            mononode_live[m] = true;
+            mononode_stack.push_back(m);
+        }
+    };
+
+    // Mark
+    mark_mononode(one_m_);
+    mark_polynode(zero_p_);
+    mark_polynode(one_p_);
+    for (const std::pair<const PolynodeId, int> &p : pinned_) mark_polynode(p.first);
+    for (const PolynodeId p : roots) mark_polynode(p);
+    for (const MononodeId m : mononode_roots) mark_mononode(m);
+
+    while (!polynode_stack.empty() || !mononode_stack.empty()) {
+        if (!polynode_stack.empty()) {
+            const PolynodeId p = polynode_stack.back();
+            polynode_stack.pop_back();
+            for (const std::pair<MononodeId, R> &summand : polynodes_[p].summands_) mark_mononode(summand.first);
+        } else {
+            const MononodeId m = mononode_stack.back();
+            mononode_stack.pop_back();
+            for (const Factor &f : mononodes_[m].factors_) {
+                if (node_live[f.id]) continue;
+                node_live[f.id] = true;
+                if (nodes_[f.id].type_ == NodeType::POL) mark_polynode(nodes_[f.id].pol_);
+            }
+        }
+    }
 
-    // Does not already exist
-    if (mononodes_.find(hash) == mononodes_.end()) 
-        mononodes_.insert({ hash, std::move(mononode) });
-    return &mononodes_.at(hash);
+    // Sweep
+    size_t freed = 0;
+    for (PolynodeId p = 0; p < polynodes_.size(); p++) {
+        if (polynodes_.alive(p) && !polynode_live[p]) {
+            polynodes_.erase(p);
+            freed++;
+        }
+    }
+    for (MononodeId m = 0; m < mononodes_.size(); m++) {
+        if (mononodes_.alive(m) && !mononode_live[m]) {
+            mononodes_.erase(m);
+            freed++;
+        }
+    }
+    for (NodeId n = 0; n < nodes_.size(); n++) {
+        if (nodes_.alive(n) && !node_live[n]) {
+            node_keys_.erase(nodes_[n].order_key_);
+            nodes_.erase(n);
+            freed++;
+        }
+    }
+    if (freed == 0) return 0;
+
+    // Whatever died at the end of the id ranges goes back to the allocator
+    nodes_.trim();
+    mononodes_.trim();
+    polynodes_.trim();
+
+    // The tables cannot delete, so they are rebuilt from the survivors
+    node_ids_.clear();
+    mononode_ids_.clear();
+    polynode_ids_.clear();
+    for (NodeId n = 0; n < nodes_.size(); n++) {
+        if (nodes_.alive(n)) node_ids_.insert(nodes_[n].hash, n, [this](const NodeId id) { return nodes_[id].hash; });
+    }
+    for (MononodeId m = 0; m < mononodes_.size(); m++) {
+        if (mononodes_.alive(m)) mononode_ids_.insert(mononodes_[m].hash, m, 
+                [this](const MononodeId id) { return mononodes_[id].hash; });
+    }
+    for (PolynodeId p = 0; p < polynodes_.size(); p++) {
+        if (polynodes_.alive(p)) polynode_ids_.insert(polynodes_[p].hash, p, 
+                [this](const PolynodeId id) { return polynodes_[id].hash; });
+    }
+
+    // Cached results may be gone
+    computed_.clear();
+
+    return freed;
 }
 
 template<class R>
-const algebra::Polynode<R>* algebra::NodeStore<R>::insert_polynode(Polynode<R>&& polynode) {
-    PolynodeHash hash = polynode.hash;
+void algebra::NodeStore<R>::set_concurrent(const bool concurrent) {
+    concurrent_ = concurrent;
+    node_ids_.set_concurrent(concurrent);
+    mononode_ids_.set_concurrent(concurrent);
+    polynode_ids_.set_concurrent(concurrent);
+    computed_.set_concurrent(concurrent);
+}
 
-    // Does not already exist
-    if (polynodes_.find(hash) == polynodes_.end()) 
-        polynodes_.insert({ hash, std::move(polynode) });
-    return &polynodes_.at(hash);
+template<class R>
+bool algebra::NodeStore<R>::is_concurrent() const {
+    return concurrent_;
 }
 
+template<class R>
+void algebra::NodeStore<R>::set_cache_bits(const int bits) 
+    { computed_.resize(bits); }
+
+template<class R>
+const algebra::ComputedTable& algebra::NodeStore<R>::get_cache() const 
+    { return computed_; }
+
 template<class R>
 size_t algebra::NodeStore<R>::get_node_store_size() const 
-    { return nodes_.size(); }
+    { return nodes_.count(); }
 
 template<class R>
 size_t algebra::NodeStore<R>::get_mononode_store_size() const 
-    { return mononodes_.size(); }
+    { return mononodes_.count(); }
 
 template<class R>
 size_t algebra::NodeStore<R>::get_polynode_store_size() const 
-    { return polynodes_.size(); }
+    { return polynodes_.count(); }
 
 template<class R>
-void algebra::NodeStore<R>::dump() const {
-    std::vector<NodeHash> node_keys;
-    node_keys.reserve(nodes_.size());
+void algebra::NodeStore<R>::reset() {
+    nodes_.reset();
+    mononodes_.reset();
+    polynodes_.reset();
+
+    node_ids_.clear();
+    mononode_ids_.clear();
+    polynode_ids_.clear();
+
+    node_keys_.clear();
+    computed_.clear();
+    pinned_.clear();
 
-    for (const std::pair<const NodeHash, Node<R>>& node : nodes_) node_keys.push_back(node.first);
+    init_constants();
+}
+
+template<class R>
+void algebra::NodeStore<R>::dump() const {
+    std::vector<NodeId> node_keys(nodes_.size());
+    std::iota(node_keys.begin(), node_keys.end(), 0);
+    node_keys.erase(std::remove_if(node_keys.begin(), node_keys.end(), 
+                [this] (const NodeId n) { return !nodes_.alive(n); }), node_keys.end());
     std::sort(node_keys.begin(), node_keys.end(), 
-            [this] (const NodeHash lhs, const NodeHash rhs) { return node_cmp(lhs, rhs) < 0;});
+            [this] (const NodeId lhs, const NodeId rhs) { return node_cmp(lhs, rhs) < 0;});
 
     std::cout << "Nodes:\n";
-    for (const NodeHash nh : node_keys) {
-        const Node<R>& node = nodes_.at(nh);
-        std::cout << node.to_string() << " " << nh << " " << node.stats << "\n";
+    for (const NodeId n : node_keys) {
+        const Node<R>& node = nodes_[n];
+        std::cout << node.to_string() << " " << node.hash << " " << node.stats << "\n";
     }
     std::cout << std::flush;
 
-    std::vector<MononodeHash> mononode_keys;
-    mononode_keys.reserve(mononodes_.size());
-
-    for (const std::pair<const MononodeHash, Mononode<R>>& mononode : mononodes_) mononode_keys.push_back(mononode.first);
+    std::vector<MononodeId> mononode_keys(mononodes_.size());
+    std::iota(mononode_keys.begin(), mononode_keys.end(), 0);
+    mononode_keys.erase(std::remove_if(mononode_keys.begin(), mononode_keys.end(), 
+                [this] (const MononodeId m) { return !mononodes_.alive(m); }), mononode_keys.end());
     std::sort(mononode_keys.begin(), mononode_keys.end(),
-            [this] (const MononodeHash lhs, const MononodeHash rhs) { return mononode_cmp(lhs, rhs) < 0;});
+            [this] (const MononodeId lhs, const MononodeId rhs) { return mononode_cmp(lhs, rhs) < 0;});
 
     std::cout << "Mononodes:\n";
-    for (const MononodeHash mh : mononode_keys) {
-        const Mononode<R>& mononode = mononodes_.at(mh);
-        std::cout << mononode.to_string() << " " << mh << " " << mononode.stats << " " << mononode.get_degree() << "\n";
+    for (const MononodeId m : mononode_keys) {
+        const Mononode<R>& mononode = mononodes_[m];
+        std::cout << mononode.to_string() << " " << mononode.hash << " " << mononode.stats << " " << mononode.get_degree() << "\n";
     }
     std::cout << std::flush;
 
     std::cout << "Polynodes:\n";
-    for (const std::pair<const PolynodeHash, Polynode<R>>& polynode : polynodes_) {
-        std::cout << polynode.second.to_string() << " " << polynode.first << " " << polynode.second.stats << "\n";
+    for (PolynodeId p = 0; p < polynodes_.size(); p++) {
+        if (!polynodes_.alive(p)) continue;
+        const Polynode<R>& polynode = polynodes_[p];
+        std::cout << polynode.to_string() << " " << polynode.hash << " " << polynode.stats << "\n";
     }
     std::cout << std::flush;
 }
@@ -249,19 +507,9 @@ void algebra::NodeStore<R>::dump() const {
 // Inside f(polynodes), it is weight order
 // Inside variables, it is lex
 template<class R>
-int algebra::NodeStore<R>::node_cmp(const NodeHash lhs, const NodeHash rhs) const {
-    const algebra::Node<R>* const lhs_ptr = get_node(lhs), *rhs_ptr = get_node(rhs);
-
-    if (lhs_ptr->type_ != rhs_ptr->type_) return lhs_ptr->type_ == NodeType::POL ? -1 : 1;
-
-    if (lhs_ptr->type_ == NodeType::POL) {
-        if (lhs_ptr->stats.weight != rhs_ptr->stats.weight) return rhs_ptr->stats.weight - lhs_ptr->stats.weight;
-        
-        // They are both f(polynode), with the same weight, arbitrarily tiebreak
-        return (lhs == rhs) ? 0 : (lhs < rhs ? -1 : 1);
-    } 
-    // They are both variables
-    return lhs_ptr->var_ - rhs_ptr->var_;
+int algebra::NodeStore<R>::node_cmp(const NodeId lhs, const NodeId rhs) const {
+    const uint64_t lhs_key = get_node(lhs)->order_key_, rhs_key = get_node(rhs)->order_key_;
+    return lhs_key == rhs_key ? 0 : (lhs_key < rhs_key ? -1 : 1);
 }
 
 /*
@@ -272,35 +520,14 @@ int algebra::NodeStore<R>::node_cmp(const NodeHash lhs, const NodeHash rhs) cons
  */ 
 
 template<class R>
-int algebra::NodeStore<R>::mononode_cmp(const MononodeHash lhs, const MononodeHash rhs) const {
-    const Mononode<R>* const lhs_ptr = get_mononode(lhs), *rhs_ptr = get_mononode(rhs);
-    //std::cout << "Comparing: " << lhs << " " << lhs_ptr->to_string() << " " << rhs << " " << rhs_ptr->to_string() << "\n";
-    if (lhs_ptr->pol_degree_ != rhs_ptr->pol_degree_) 
-        return -(lhs_ptr->pol_degree_ - rhs_ptr->pol_degree_); // Reverse
-
-    bool on_vars = false;
-    auto lhs_it = lhs_ptr->begin(), rhs_it = rhs_ptr->begin(),
-         lhs_end = lhs_ptr->end(), rhs_end = rhs_ptr->end();
-
-    for (; lhs_it != lhs_end && rhs_it != rhs_end; lhs_it++, rhs_it++) {
-        // The first time we run out of polynodes, check for var degree
-        //
-        // Note that if nothing has returned before this point, then lhs and rhs must have
-        // the same f(polynode) parts, so we can simply check for only one of them
-        if (!on_vars && get_node(lhs_it->first)->type_ == NodeType::VAR) {
-            if (lhs_ptr->var_degree_ != rhs_ptr->var_degree_) 
-                return -(lhs_ptr->var_degree_ - rhs_ptr->var_degree_); // Reversed
-            on_vars = true;
-        }
+int algebra::NodeStore<R>::mononode_cmp(const MononodeId lhs, const MononodeId rhs) const {
+    const MononodeKey &lhs_key = get_mononode(lhs)->order_key_, &rhs_key = get_mononode(rhs)->order_key_;
 
-        if (lhs_it->first != rhs_it->first) 
-            return -node_cmp(lhs_it->first, rhs_it->first); // Reversed
-        if (lhs_it->second != rhs_it->second) 
-            return lhs_it->second < rhs_it->second ? -1 : 1; // Two reverses cancel out
+    const size_t len = std::min(lhs_key.size(), rhs_key.size());
+    for (size_t i = 0; i < len; i++) {
+        if (lhs_key[i] != rhs_key[i]) return lhs_key[i] < rhs_key[i] ? -1 : 1;
     }
-
-    // We might never hit the on_vars if statement, so we need to check here 
-    return -(lhs_ptr->var_degree_ - rhs_ptr->var_degree_); // Reverse
+    return lhs_key.size() == rhs_key.size() ? 0 : (lhs_key.size() < rhs_key.size() ? -1 : 1);
 }
 
 
@@ -309,14 +536,20 @@ int algebra::NodeStore<R>::mononode_cmp(const MononodeHash lhs, const MononodeHa
  */
 
 template<class R>
-algebra::Node<R>::Node(const PolynodeHash pol, NodeStore<R> &node_store) :
-    NodeBase(node_store.hash(pol), from_polynode_stats(node_store.get_polynode(pol)->stats)),
-    type_(NodeType::POL), pol_(pol), var_(0), node_store_(node_store) {}
+algebra::Node<R>::Node(const PolynodeId pol, const NodeHash hash, NodeStore<R> &node_store) :
+    NodeBase(hash, from_polynode_stats(node_store.get_polynode(pol)->stats)),
+    inv_hash_(inv_p(hash)), type_(NodeType::POL), 
+    // Heavier first, the top bits of the hash break ties (the store resolves collisions)
+    order_key_((uint64_t(0x7fffffff - std::min(stats.weight, 0x7fffffff)) << 32) | (hash >> 30)),
+    pol_(pol), var_(0), node_store_(node_store) {}
 
 template<class R>
-algebra::Node<R>::Node(const Idx var, NodeStore<R> &node_store) : 
-    NodeBase(node_store.hash(var), NodeStats(2, 0, 0, 2)), 
-    type_(NodeType::VAR), pol_(0), var_(var), node_store_(node_store) {}
+algebra::Node<R>::Node(const Idx var, const NodeHash hash, NodeStore<R> &node_store) : 
+    NodeBase(hash, NodeStats(2, 0, 0, 2, VarSet::of(var))), 
+    inv_hash_(inv_p(hash)), type_(NodeType::VAR), 
+    // Variables after every f(polynode)
+    order_key_((uint64_t(1) << 63) | uint32_t(var)),
+    pol_(0), var_(var), node_store_(node_store) {}
 
 template<class R>
 std::string algebra::Node<R>::to_string() const {
@@ -332,7 +565,7 @@ template<class R>
 algebra::NodeType algebra::Node<R>::get_type() const { return type_; }
 
 template<class R>
-algebra::PolynodeHash algebra::Node<R>::get_polynode_hash() const { return pol_; }
+algebra::PolynodeId algebra::Node<R>::get_polynode_id() const { return pol_; }
 
 template<class R>
 algebra::Idx algebra::Node<R>::get_var() const { return var_; }
@@ -341,77 +574,116 @@ algebra::Idx algebra::Node<R>::get_var() const { return var_; }
  * Mononode
  */
 template<class R>
-std::map<algebra::NodeHash, int, std::function<bool(const algebra::NodeHash, const algebra::NodeHash)>> 
-    algebra::Mononode<R>::clean_factors(const std::unordered_map<NodeHash, int> &factors, NodeStore<R> &node_store) {
+algebra::FactorVec algebra::Mononode<R>::clean_factors(const std::unordered_map<NodeId, int> &factors, 
+        NodeStore<R> &node_store) {
+    FactorVec res;
+    res.reserve(factors.size());
+    for (const std::pair<const NodeId, int>& cur : factors) {
+        if (cur.second > 0) res.push_back(Factor{node_store.get_node(cur.first)->order_key_, cur.first, cur.second});
+    }
+    std::sort(res.begin(), res.end(), [&node_store] (const Factor& lhs, const Factor& rhs)
+            { return node_store.factor_cmp(lhs, rhs) < 0; });
 
-    std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>> res(
-        [&node_store] (const NodeHash lhs, const NodeHash rhs)
-            { return node_store.node_cmp(lhs, rhs) < 0; }
-        );
-    for (const std::pair<const NodeHash, int>& cur : factors) {
-        if(cur.second > 0) res[cur.first] = cur.second;
+    return res;
+}
+
+template<class R>
+uint64_t algebra::Mononode<R>::make_sieve(const FactorVec &factors, const NodeStore<R> &node_store) {
+    uint64_t res = 0;
+    for (const Factor &f : factors) res |= uint64_t(1) << (node_store.get_node(f.id)->hash % 64);
+    return res;
+}
+
+template<class R>
+algebra::PackedExps algebra::Mononode<R>::pack(const FactorVec &factors, const NodeStore<R> &node_store) {
+    PackedExps res;
+    for (const Factor &f : factors) {
+        const Node<R>* n = node_store.get_node(f.id);
+        if (n->get_type() != NodeType::VAR || !PackedExps::fits(n->get_var(), f.exp)) return res;
+        res.set(n->get_var(), f.exp);
     }
+    res.valid = true;
+    return res;
+}
 
+// Variables order by their index, so the lanes come out sorted
+template<class R>
+algebra::FactorVec algebra::Mononode<R>::unpack(const PackedExps &packed, const NodeStore<R> &node_store) {
+    FactorVec res;
+    for (Idx var = 0; var < PackedExps::LANES; var++) {
+        const int exp = packed.get(var);
+        if (exp == 0) continue;
+        const NodeId id = node_store.var_nodes_[var];
+        res.push_back(Factor{node_store.get_node(id)->order_key_, id, exp});
+    }
     return res;
 }
 
 template<class R>
-algebra::Mononode<R>::Mononode(
-        const std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>&& factors, 
-        NodeStore<R> &node_store) : 
-    NodeBase(
-         std::accumulate(factors.begin(), factors.end(), MononodeHash(1),
-            [](MononodeHash hash, const std::pair<NodeHash, int>& cur) { 
-                return hash + cur.first * NodeHash(cur.second);
-            }), 
-         factors.size() == 0 ? NodeStats(0, 0, 0, 1) :
-         std::accumulate(factors.begin(), factors.end(), NodeStats(), 
-            [&node_store](NodeStats &stats, const std::pair<NodeHash, int>& cur) { 
-                return stats.add_node(node_store.get_node(cur.first)->stats, cur.second);
-            })
-        ), 
-    factors_(std::move(factors)),
-    var_degree_(
-         std::accumulate(factors.begin(), factors.end(), 0,
-            [&node_store = node_store](int deg, const std::pair<const NodeHash, int>& cur) { 
-                return deg + (node_store.get_node(cur.first)->get_type() == NodeType::VAR ? cur.second : 0);
-            })
-        ),
-    pol_degree_(
-         std::accumulate(factors.begin(), factors.end(), 0,
-            [&node_store = node_store](int deg, const std::pair<const NodeHash, int>& cur) { 
-                return deg + (node_store.get_node(cur.first)->get_type() == NodeType::POL ? cur.second : 0);
-            })
-        ),
-    node_store_(node_store) {}
+algebra::MononodeHash algebra::Mononode<R>::hash_factors(const FactorVec &factors, const NodeStore<R> &node_store) {
+    return std::accumulate(factors.begin(), factors.end(), MononodeHash(1),
+            [&node_store](MononodeHash hash, const Factor& cur) { 
+                return mul_p(hash, pow_p(node_store.get_node(cur.id)->hash, cur.exp));
+            });
+}
 
+/*
+ * The order of NodeStore::mononode_cmp, as words: the f(polynode) degree, then each f(polynode) factor, then the variable degree,
+ * then each variable factor, where a factor is its node key followed by its exponent.
+ * Larger degrees and later nodes lead, so those words are complemented.
+ * Of two different mononodes, neither key can be a prefix of the other
+ */ 
 template<class R>
-algebra::Mononode<R>::Mononode(const std::unordered_map<NodeHash, int>& factors, 
-        NodeStore<R> &node_store) : 
-    NodeBase(
-         std::accumulate(factors.begin(), factors.end(), MononodeHash(1),
-            [](MononodeHash hash, const std::pair<NodeHash, int>& cur) { 
-                    return hash + cur.first * NodeHash(cur.second);
-                }), 
+algebra::MononodeKey algebra::Mononode<R>::make_key(const FactorVec &factors, const int var_degree, const int pol_degree) {
+    MononodeKey key;
+    key.reserve(2 * factors.size() + 2);
+
+    key.push_back(~uint64_t(pol_degree));
+    bool on_vars = false;
+    for (const Factor &f : factors) {
+        if (!on_vars && (f.key >> 63)) {
+            key.push_back(~uint64_t(var_degree));
+            on_vars = true;
+        }
+        key.push_back(~f.key);
+        key.push_back(uint64_t(f.exp));
+    }
+    if (!on_vars) key.push_back(~uint64_t(var_degree));
+
+    return key;
+}
+
+template<class R>
+algebra::Mononode<R>::Mononode(FactorVec&& factors, const MononodeHash hash, NodeStore<R> &node_store) : 
+    NodeBase(hash, 
          factors.size() == 0 ? NodeStats(0, 0, 0, 1) :
          std::accumulate(factors.begin(), factors.end(), NodeStats(), 
-            [&node_store](NodeStats &stats, const std::pair<NodeHash, int>& cur) { 
-                return stats.add_node(node_store.get_node(cur.first)->stats, cur.second);
+            [&node_store](NodeStats &stats, const Factor& cur) { 
+                return stats.add_node(node_store.get_node(cur.id)->stats, cur.exp);
             })
         ), 
-    factors_(std::move(clean_factors(factors, node_store))),
+    inv_hash_(
+         std::accumulate(factors.begin(), factors.end(), MononodeHash(1),
+            [&node_store](MononodeHash hash, const Factor& cur) { 
+                return mul_p(hash, pow_p(node_store.get_node(cur.id)->inv_hash_, cur.exp));
+            })
+        ),
+    factors_(std::move(factors)),
     var_degree_(
-         std::accumulate(factors.begin(), factors.end(), 0,
-            [&node_store = node_store](int deg, const std::pair<NodeHash, int>& cur) { 
-                return deg + (node_store.get_node(cur.first)->get_type() == NodeType::VAR ? cur.second : 0);
+         std::accumulate(factors_.begin(), factors_.end(), 0,
+            [&node_store = node_store](int deg, const Factor& cur) { 
+                return deg + (node_store.get_node(cur.id)->get_type() == NodeType::VAR ? cur.exp : 0);
             })
         ),
     pol_degree_(
-         std::accumulate(factors.begin(), factors.end(), 0,
-            [&node_store = node_store](int deg, const std::pair<NodeHash, int>& cur) { 
-                return deg + (node_store.get_node(cur.first)->get_type() == NodeType::POL ? cur.second : 0);
+         std::accumulate(factors_.begin(), factors_.end(), 0,
+            [&node_store = node_store](int deg, const Factor& cur) { 
+                return deg + (node_store.get_node(cur.id)->get_type() == NodeType::POL ? cur.exp : 0);
             })
         ),
+    order_key_(make_key(factors_, var_degree_, pol_degree_)),
+    packed_(pack(factors_, node_store)),
+    sieve_(make_sieve(factors_, node_store)),
     node_store_(node_store) {}
 
 template<class R>
@@ -419,128 +691,162 @@ std::string algebra::Mononode<R>::to_string() const {
     if (factors_.empty()) return "";
 
     // Joins strings by a space
-    std::string res = node_store_.get_node(begin()->first)->to_string();
+    std::string res = node_store_.get_node(begin()->id)->to_string();
     for (auto it = begin(); it != end(); it++) {
-        for (int rep = (it == begin()); rep < it->second; rep++) { 
+        for (int rep = (it == begin()); rep < it->exp; rep++) { 
             res += " ";
-            res += node_store_.get_node(it->first)->to_string();
+            res += node_store_.get_node(it->id)->to_string();
         }
     }
     return res;
 }
 
+template<class R>
+template<class Op>
+bool algebra::Mononode<R>::merge(const Mononode<R>& rhs, Op&& op) const {
+    auto itl = factors_.begin(), itr = rhs.factors_.begin();
+    const auto endl = factors_.end(), endr = rhs.factors_.end();
+    while (itl != endl || itr != endr) {
+        const int cmp = itl == endl ? 1 : (itr == endr ? -1 : node_store_.factor_cmp(*itl, *itr));
+        bool cont;
+        if (cmp < 0) {
+            cont = op(*itl, itl->exp, 0);
+            itl++;
+        } else if (cmp > 0) {
+            cont = op(*itr, 0, itr->exp);
+            itr++;
+        } else {
+            cont = op(*itl, itl->exp, itr->exp);
+            itl++; itr++;
+        }
+        if (!cont) return false;
+    }
+    return true;
+}
+
+template<class R>
+bool algebra::Mononode<R>::is_product(const Mononode<R>& lhs, const Mononode<R>& rhs) const {
+    if (get_degree() != lhs.get_degree() + rhs.get_degree()) return false;
+
+    const PackedExps product = lhs.packed_ + rhs.packed_;
+    if (product.valid) return packed_ == product;
+
+    // Exponents are positive, so the merged factors of lhs and rhs must be exactly ours
+    auto it = factors_.begin();
+    const bool matches = lhs.merge(rhs, [this, &it](const Factor& f, const int lhs_exp, const int rhs_exp) {
+                if (it == factors_.end() || it->id != f.id || it->exp != lhs_exp + rhs_exp) return false;
+                it++;
+                return true;
+            });
+    return matches && it == factors_.end();
+}
+
 template<class R>
 const algebra::Mononode<R>* algebra::Mononode<R>::operator*(const Mononode<R>& rhs) const {
     // Very inexpensive to compute the hash first,
     // test if it is a repeat, and if not, compute the whole thing
-    MononodeHash product_hash = hash * rhs.hash;
-    const Mononode<R>* cached = node_store_.get_mononode(product_hash);
+    MononodeHash product_hash = mul_p(hash, rhs.hash);
+    const Mononode<R>* cached = node_store_.find_mononode(product_hash, 
+            [this, &rhs](const Mononode<R>& candidate) { return candidate.is_product(*this, rhs); });
 
     if (cached != nullptr) return cached;
 
-    std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>
-        combined_factors(factors_.begin(), factors_.end(), 
-        [&node_store = node_store_] (const NodeHash lhs, const NodeHash rhs) 
-            { return node_store.node_cmp(lhs, rhs) < 0; }
-        );
-    for (const std::pair<const NodeHash, int> &rhs_entry : rhs.factors_) {
-        combined_factors[rhs_entry.first] += rhs_entry.second;
-    }
+    const PackedExps product = packed_ + rhs.packed_;
+    if (product.valid) return node_store_.intern_mononode(unpack(product, node_store_), product_hash);
 
-    return node_store_.insert_mononode(Mononode<R>(std::move(combined_factors), node_store_));
+    FactorVec combined_factors;
+    combined_factors.reserve(factors_.size() + rhs.factors_.size());
+    merge(rhs, [&combined_factors](const Factor& f, const int lhs_exp, const int rhs_exp) {
+                combined_factors.push_back(Factor{f.key, f.id, lhs_exp + rhs_exp});
+                return true;
+            });
+
+    return node_store_.intern_mononode(std::move(combined_factors), product_hash);
 }
 
 template<class R>
 const algebra::Mononode<R>* algebra::Mononode<R>::lcm(const algebra::Mononode<R>& rhs) const {
-    std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>
-        lcm([&node_store = node_store_] (const NodeHash lhs, const NodeHash rhs) 
-            { return node_store.node_cmp(lhs, rhs) < 0; }
-        );
-    
-    for (const std::pair<const NodeHash, int> &lhs_entry : factors_) {
-        const NodeHash p = lhs_entry.first;
-        const int lhs_exp = lhs_entry.second;
-        if (rhs.factors_.find(p) == rhs.factors_.end()) {
-            lcm[p] = lhs_exp;
-        } else {
-            lcm[p] = std::max(rhs.factors_.at(p), lhs_exp);
-        }
+    if (packed_.valid && rhs.packed_.valid) {
+        FactorVec lcm = unpack(packed_.lcm(rhs.packed_), node_store_);
+        const MononodeHash lcm_hash = hash_factors(lcm, node_store_);
+        return node_store_.intern_mononode(std::move(lcm), lcm_hash);
     }
 
-    for (const std::pair<const NodeHash, int> &rhs_entry : rhs.factors_) {
-        const NodeHash p = rhs_entry.first;
-        const int rhs_exp = rhs_entry.second;
-        if (factors_.find(p) == factors_.end()) {
-            lcm[p] = rhs_exp;
-        } 
-        // Overlaps are already handled by the above
-    }
+    FactorVec lcm;
+    lcm.reserve(factors_.size() + rhs.factors_.size());
+    merge(rhs, [&lcm](const Factor& f, const int lhs_exp, const int rhs_exp) {
+                lcm.push_back(Factor{f.key, f.id, std::max(lhs_exp, rhs_exp)});
+                return true;
+            });
 
-    return node_store_.insert_mononode(Mononode<R>(std::move(lcm), node_store_));
+    return node_store_.intern_mononode(std::move(lcm), hash_factors(lcm, node_store_));
 }
 
 template<class R>
-std::pair<const algebra::Mononode<R>*, const algebra::Mononode<R>*> 
-algebra::Mononode<R>::symmetric_q(const Mononode<R>& rhs) const {
-    std::map<NodeHash, int, std::function<bool(const NodeHash, const NodeHash)>>
-        q_lhs([&node_store = node_store_] (const NodeHash lhs, const NodeHash rhs) 
-            { return node_store.node_cmp(lhs, rhs) < 0; }
-        ), 
-        q_rhs([&node_store = node_store_] (const NodeHash lhs, const NodeHash rhs) 
-            { return node_store.node_cmp(lhs, rhs) < 0; }
-        );
-    
-    for (const std::pair<const NodeHash, int> &lhs_entry : factors_) {
-        const NodeHash p = lhs_entry.first;
-        const int lhs_exp = lhs_entry.second;
-        if (rhs.factors_.find(p) == rhs.factors_.end()) {
-            q_rhs[p] = lhs_exp;
-        } else {
-            const int rhs_exp = rhs.factors_.at(p);
+const algebra::Mononode<R>* algebra::Mononode<R>::operator/(const Mononode<R>& rhs) const {
+    MononodeHash quotient_hash = mul_p(hash, rhs.inv_hash_);
+    const Mononode<R>* cached = node_store_.find_mononode(quotient_hash, 
+            [this, &rhs](const Mononode<R>& candidate) { return is_product(candidate, rhs); });
 
-            if (rhs_exp < lhs_exp) {
-                q_rhs[p] = lhs_exp - rhs_exp;
-            } else if (rhs_exp > lhs_exp) {
-                q_lhs[p] = rhs_exp - lhs_exp;
-            }
-        }
+    if (cached != nullptr) return cached;
+
+    if (packed_.valid && rhs.packed_.valid) {
+        return node_store_.intern_mononode(unpack(packed_ - rhs.packed_, node_store_), quotient_hash);
     }
 
-    for (const std::pair<const NodeHash, int> &rhs_entry : rhs.factors_) {
-        const NodeHash p = rhs_entry.first;
-        const int rhs_exp = rhs_entry.second;
-        if (factors_.find(p) == factors_.end()) {
-            q_lhs[p] = rhs_exp;
-        } 
-        // Overlaps are already handled by the above
+    FactorVec quotient;
+    quotient.reserve(factors_.size());
+    merge(rhs, [&quotient](const Factor& f, const int lhs_exp, const int rhs_exp) {
+                if (lhs_exp > rhs_exp) quotient.push_back(Factor{f.key, f.id, lhs_exp - rhs_exp});
+                return true;
+            });
+
+    return node_store_.intern_mononode(std::move(quotient), quotient_hash);
+}
+
+template<class R>
+std::pair<const algebra::Mononode<R>*, const algebra::Mononode<R>*> 
+algebra::Mononode<R>::symmetric_q(const Mononode<R>& rhs) const {
+    FactorVec q_lhs, q_rhs;
+    if (packed_.valid && rhs.packed_.valid) {
+        const PackedExps lcm = packed_.lcm(rhs.packed_);
+        q_lhs = unpack(lcm - packed_, node_store_);
+        q_rhs = unpack(lcm - rhs.packed_, node_store_);
+    } else {
+        merge(rhs, [&q_lhs, &q_rhs](const Factor& f, const int lhs_exp, const int rhs_exp) {
+                    if (rhs_exp > lhs_exp) {
+                        q_lhs.push_back(Factor{f.key, f.id, rhs_exp - lhs_exp});
+                    } else if (lhs_exp > rhs_exp) {
+                        q_rhs.push_back(Factor{f.key, f.id, lhs_exp - rhs_exp});
+                    }
+                    return true;
+                });
     }
 
-    return {node_store_.insert_mononode(Mononode<R>(std::move(q_lhs), node_store_)),
-            node_store_.insert_mononode(Mononode<R>(std::move(q_rhs), node_store_))};
+    const MononodeHash q_lhs_hash = hash_factors(q_lhs, node_store_), q_rhs_hash = hash_factors(q_rhs, node_store_);
+    return {node_store_.intern_mononode(std::move(q_lhs), q_lhs_hash),
+            node_store_.intern_mononode(std::move(q_rhs), q_rhs_hash)};
 }
 
 template<class R>
 bool algebra::Mononode<R>::divisible(const Mononode<R>& rhs) const {
-    for (const std::pair<const NodeHash, int> &rhs_entry : rhs.factors_) {
-        const NodeHash p = rhs_entry.first;
-        const int rhs_exp = rhs_entry.second;
-        auto it = factors_.find(p);
-        if (it == factors_.end()) {
-            return false;
-        } else if (it->second < rhs_exp) {
-            return false;
-        }
-    }
-    return true;
+    // Nearly every candidate divisor fails here
+    if ((rhs.sieve_ & ~sieve_) != 0 || rhs.factors_.size() > factors_.size()) return false;
+
+    // Anything that divides a packed mononode is packed
+    if (packed_.valid) return rhs.packed_.valid && packed_.divisible(rhs.packed_);
+
+    return merge(rhs, [](const Factor&, const int lhs_exp, const int rhs_exp) { return lhs_exp >= rhs_exp; });
 }
 
 template<class R>
-std::map<algebra::NodeHash, int, std::function<bool(const algebra::NodeHash, const algebra::NodeHash)>>::const_iterator
-    algebra::Mononode<R>::begin() const { return factors_.begin(); }
+uint64_t algebra::Mononode<R>::get_sieve() const { return sieve_; }
 
 template<class R>
-std::map<algebra::NodeHash, int, std::function<bool(const algebra::NodeHash, const algebra::NodeHash)>>::const_iterator
-    algebra::Mononode<R>::end() const { return factors_.end(); }
+algebra::FactorVec::const_iterator algebra::Mononode<R>::begin() const { return factors_.begin(); }
+
+template<class R>
+algebra::FactorVec::const_iterator algebra::Mononode<R>::end() const { return factors_.end(); }
 
 template<class R>
 int algebra::Mononode<R>::get_degree() const { return var_degree_ + pol_degree_; }
@@ -549,17 +855,95 @@ int algebra::Mononode<R>::get_degree() const { return var_degree_ + pol_degree_;
  * Polynode
  */
 
+// Reduces r modulo HASH_P into h
+// Returns false if r has no image, in which case h is an ordinary hash of r
 template<class R>
-algebra::PolynodeHash to_polynode_hash(const R &r) {
-    return algebra::PolynodeHash(r);
+bool to_polynode_hash(const R &r, algebra::PolynodeHash &h) {
+    h = r < 0 ? neg_p(mod_p(uint64_t(-int64_t(r)))) : mod_p(uint64_t(r));
+    return true;
+}
+
+uint64_t hash_mpz(uint64_t conj, const mpz_class &z) {
+    uint64_t h = fast_hash(conj, uint64_t(mpz_size(z.get_mpz_t())) ^ uint64_t(mpz_sgn(z.get_mpz_t()) < 0));
+    for (size_t i = 0; i < mpz_size(z.get_mpz_t()); i++) {
+        h = fast_hash(h, uint64_t(mpz_getlimbn(z.get_mpz_t(), i)));
+    }
+    return h;
 }
 
 template<>
-algebra::PolynodeHash to_polynode_hash(const mpq_class &r) {
-    // Quick and dirty rational hash
-    double d = r.get_d();
-    uint64_t* ptr = (uint64_t*) &d;
-    return fast_hash(0x93c467e37db0c7a4, *ptr);
+bool to_polynode_hash(const mpq_class &r, algebra::PolynodeHash &h) {
+    h = mpz_fdiv_ui(r.get_num_mpz_t(), HASH_P);
+    if (r.get_den() == 1) return true;
+
+    const uint64_t den = mpz_fdiv_ui(r.get_den_mpz_t(), HASH_P);
+    if (den != 0) {
+        h = mul_p(h, inv_p(den));
+        return true;
+    }
+
+    // Only if the denominator is a multiple of HASH_P
+    h = mod_p(hash_mpz(hash_mpz(0x93c467e37db0c7a4, r.get_num()), r.get_den()));
+    return false;
+}
+
+// Arithmetic mod a word sized prime has nothing to do with arithmetic mod HASH_P, so there is no image.
+// Hashing the reconstructed fraction still agrees with Q on small coefficients, and so does the node order
+template<>
+bool to_polynode_hash(const coeff::ModP &r, algebra::PolynodeHash &h) {
+    int64_t num, den;
+    if (!r.rational(num, den)) {
+        num = r.signed_value();
+        den = 1;
+    }
+    h = num < 0 ? neg_p(mod_p(uint64_t(-num))) : mod_p(uint64_t(num));
+    if (den != 1) h = mul_p(h, inv_p(uint64_t(den)));
+    return false;
+}
+
+template<>
+bool to_polynode_hash(const coeff::SmallQ &r, algebra::PolynodeHash &h) {
+    if (!r.is_small()) return to_polynode_hash(r.get_mpq(), h);
+
+    // Same image as the mpq_class of the same value
+    const int64_t num = r.num();
+    h = num < 0 ? neg_p(mod_p(uint64_t(-num))) : mod_p(uint64_t(num));
+    if (r.den() == 1) return true;
+
+    const uint64_t den = mod_p(uint64_t(r.den()));
+    if (den != 0) {
+        h = mul_p(h, inv_p(den));
+        return true;
+    }
+    return to_polynode_hash(r.get_mpq(), h);
+}
+
+// Encodes r exactly in a word, for keying the computed table
+// Returns false if it does not fit, then r is not cached
+template<class R>
+bool to_cache_key(const R &r, uint64_t &key) {
+    key = uint64_t(int64_t(r));
+    return true;
+}
+
+template<>
+bool to_cache_key(const mpq_class &r, uint64_t &key) {
+    if (!mpz_fits_sint_p(r.get_num_mpz_t()) || !mpz_fits_uint_p(r.get_den_mpz_t())) return false;
+    key = uint64_t(uint32_t(int32_t(mpz_get_si(r.get_num_mpz_t())))) << 32 | mpz_get_ui(r.get_den_mpz_t());
+    return true;
+}
+
+template<>
+bool to_cache_key(const coeff::ModP &r, uint64_t &key) {
+    key = r.value();
+    return true;
+}
+
+template<>
+bool to_cache_key(const coeff::SmallQ &r, uint64_t &key) {
+    if (!r.is_small() || r.num() < INT32_MIN || r.num() > INT32_MAX || r.den() > UINT32_MAX) return false;
+    key = uint64_t(uint32_t(int32_t(r.num()))) << 32 | uint64_t(r.den());
+    return true;
 }
 
 template<class R>
@@ -572,19 +956,29 @@ std::string algebra::R_to_string(const mpq_class &r) {
     return r.get_str();
 }
 
+template<>
+std::string algebra::R_to_string(const coeff::ModP &r) {
+    return coeff::to_string(r);
+}
+
+template<>
+std::string algebra::R_to_string(const coeff::SmallQ &r) {
+    return coeff::to_string(r);
+}
+
 template<class R>
-std::vector<std::pair<algebra::MononodeHash, R>> algebra::Polynode<R>::clean_summands(
-        const std::vector<std::pair<MononodeHash, R>> &summands, NodeStore<R> &node_store) {
+std::vector<std::pair<algebra::MononodeId, R>> algebra::Polynode<R>::clean_summands(
+        const std::vector<std::pair<MononodeId, R>> &summands, NodeStore<R> &node_store) {
 
-    std::vector<std::pair<algebra::MononodeHash, R>> res;
+    std::vector<std::pair<algebra::MononodeId, R>> res;
     res.reserve(summands.size());
 
-    for (const std::pair<MononodeHash, R>& summand : summands) {
+    for (const std::pair<MononodeId, R>& summand : summands) {
         if (summand.second != 0) res.emplace_back(std::move(summand));
     }
 
     std::sort(res.begin(), res.end(), 
-            [&node_store](const std::pair<MononodeHash, R>& lhs, const std::pair<MononodeHash, R>& rhs) {
+            [&node_store](const std::pair<MononodeId, R>& lhs, const std::pair<MononodeId, R>& rhs) {
                 return node_store.mononode_cmp(lhs.first, rhs.first) < 0;
             }
         );
@@ -592,35 +986,30 @@ std::vector<std::pair<algebra::MononodeHash, R>> algebra::Polynode<R>::clean_sum
 }
 
 template<class R>
-algebra::Polynode<R>::Polynode(const std::vector<std::pair<MononodeHash, R>>&& summands, 
-        NodeStore<R> &node_store) : 
-    NodeBase(std::accumulate(summands.begin(), summands.end(), PolynodeHash(0), 
-                [&node_store] (const PolynodeHash hash, const std::pair<MononodeHash, R>& cur) { 
-                    // Must combine with a commutative operation in order to create same hash as unsorted
-                    return hash ^ node_store.hash(PolynodeHash(cur.first) + to_polynode_hash(cur.second));
-                }), 
-             std::accumulate(summands.begin(), summands.end(), NodeStats(), 
-                [&node_store] (NodeStats &stats, const std::pair<MononodeHash, R>& cur) { 
-                    return stats.add_mononode(node_store.get_mononode(cur.first)->stats, abs(cur.second) == 1);
-                })
-            ),
-    summands_(std::move(summands)), 
-    node_store_(node_store) {}
+algebra::PolynodeHash algebra::Polynode<R>::hash_summands(const std::vector<std::pair<MononodeId, R>> &summands, 
+        const NodeStore<R> &node_store, bool &homomorphic) {
+    homomorphic = true;
+    PolynodeHash hash = 0;
+    for (const std::pair<MononodeId, R> &cur : summands) {
+        PolynodeHash c;
+        homomorphic &= to_polynode_hash(cur.second, c);
+        hash = add_p(hash, mul_p(c, node_store.get_mononode(cur.first)->hash));
+    }
+    return hash;
+}
 
 template<class R>
-algebra::Polynode<R>::Polynode(const std::vector<std::pair<MononodeHash, R>>& summands, 
-        NodeStore<R> &node_store) : 
-    NodeBase(std::accumulate(summands.begin(), summands.end(), PolynodeHash(0), 
-                [&node_store] (const PolynodeHash hash, const std::pair<MononodeHash, R>& cur) { 
-                    // Must combine with a commutative operation in order to create same hash as unsorted
-                    return hash ^ node_store.hash(PolynodeHash(cur.first) + to_polynode_hash(cur.second));
-                }), 
+algebra::Polynode<R>::Polynode(std::vector<std::pair<MononodeId, R>>&& summands, const PolynodeHash hash,
+        const bool homomorphic, NodeStore<R> &node_store) : 
+    NodeBase(hash,
              std::accumulate(summands.begin(), summands.end(), NodeStats(), 
-                [&node_store] (NodeStats &stats, const std::pair<MononodeHash, R>& cur) { 
-                    return stats.add_mononode(node_store.get_mononode(cur.first)->stats, abs(cur.second) == 1);
+                [&node_store] (NodeStats &stats, const std::pair<MononodeId, R>& cur) { 
+                    return stats.add_mononode(node_store.get_mononode(cur.first)->stats, 
+                            cur.second == 1 || cur.second == -1);
                 })
             ),
-    summands_(std::move(clean_summands(summands, node_store))), 
+    summands_(std::move(summands)), 
+    homomorphic_(homomorphic),
     node_store_(node_store) {}
 
 template<class R>
@@ -656,23 +1045,44 @@ std::string algebra::Polynode<R>::to_string() const {
     return res;
 }
 
+template<class R>
+bool algebra::Polynode<R>::is_negation(const Polynode<R>& rhs) const {
+    if (summands_.size() != rhs.summands_.size()) return false;
+
+    // Negation keeps the order of the summands
+    for (size_t i = 0; i < summands_.size(); i++) {
+        if (summands_[i].first != rhs.summands_[i].first || summands_[i].second != -rhs.summands_[i].second) 
+            return false;
+    }
+    return true;
+}
+
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::operator-() const {
-    const Polynode<R>* cached = node_store_.get_polynode(-hash);
+    if (homomorphic_) {
+        const Polynode<R>* cached = node_store_.find_polynode(neg_p(hash), 
+                [this](const Polynode<R>& candidate) { return candidate.is_negation(*this); });
 
-    if (cached != nullptr) return cached;
+        if (cached != nullptr) return cached;
+    }
 
-    std::vector<std::pair<MononodeHash, R>> neg_summands(summands_);
-    for (std::pair<MononodeHash, R> &neg_entry : neg_summands) {
+    std::vector<std::pair<MononodeId, R>> neg_summands(summands_);
+    for (std::pair<MononodeId, R> &neg_entry : neg_summands) {
         neg_entry.second *= -1;
     }
 
-    return node_store_.insert_polynode(Polynode<R>(std::move(neg_summands), node_store_));
+    if (!homomorphic_) return node_store_.intern_polynode(std::move(neg_summands));
+    return node_store_.intern_polynode(std::move(neg_summands), neg_p(hash), true);
 }
 
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::operator+(const Polynode<R>& rhs) const {
-    std::vector<std::pair<MononodeHash, R>> combined_summands;
+    // Addition commutes, so only one order is cached
+    const PolynodeId a = std::min(id, rhs.id), b = std::max(id, rhs.id);
+    PolynodeId cached;
+    if (node_store_.computed_.find(CacheOp::ADD, a, b, 0, cached)) return node_store_.get_polynode(cached);
+
+    std::vector<std::pair<MononodeId, R>> combined_summands;
     combined_summands.reserve(summands_.size() + rhs.summands_.size());
 
     // Merge, assuming both are sorted
@@ -701,7 +1111,12 @@ const algebra::Polynode<R>* algebra::Polynode<R>::operator+(const Polynode<R>& r
         }
     }
                 
-    return node_store_.insert_polynode(Polynode<R>(std::move(combined_summands), node_store_));
+    const Polynode<R>* sum = !homomorphic_ || !rhs.homomorphic_ 
+        ? node_store_.intern_polynode(std::move(combined_summands))
+        : node_store_.intern_polynode(std::move(combined_summands), add_p(hash, rhs.hash), true);
+
+    node_store_.computed_.insert(CacheOp::ADD, a, b, 0, sum->id);
+    return sum;
 }
 
 template<class R>
@@ -709,49 +1124,148 @@ const algebra::Polynode<R>* algebra::Polynode<R>::operator-(const Polynode<R>& r
     return *this + *(-rhs);
 }
 
-// Expensive function, but this won't be called too often
+// Johnson's heap multiplication: the products are streamed in order, 
+// with one heap entry per summand of the shorter operand
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::operator*(const Polynode<R>& rhs) const {
-    // The idea is that once we generate the cartesian product, we must
-    //  1) combine like monomials
-    //  2) sort monomials
-    // We can do both of these with a heap! (here implemented with std::map)
-    std::map<MononodeHash, R, std::function<bool(const MononodeHash, const MononodeHash)>> 
-        combined_summands([&node_store = node_store_] (const MononodeHash lhs, const MononodeHash rhs) {
-                    return node_store.mononode_cmp(lhs, rhs) < 0;
-                });
-
-    for (const std::pair<MononodeHash, R> &lhs_entry : summands_) {
-        for (const std::pair<MononodeHash, R> &rhs_entry : rhs.summands_) {
-            const Mononode<R>* prod = *node_store_.get_mononode(lhs_entry.first) 
-                * *node_store_.get_mononode(rhs_entry.first);
-            combined_summands[prod->hash] += lhs_entry.second * rhs_entry.second;
-        }
+    const PolynodeId a = std::min(id, rhs.id), b = std::max(id, rhs.id);
+    PolynodeId cached;
+    if (node_store_.computed_.find(CacheOp::MUL, a, b, 0, cached)) return node_store_.get_polynode(cached);
+
+    const std::vector<std::pair<MononodeId, R>> &outer = summands_.size() <= rhs.summands_.size() 
+        ? summands_ : rhs.summands_;
+    const std::vector<std::pair<MononodeId, R>> &inner = summands_.size() <= rhs.summands_.size() 
+        ? rhs.summands_ : summands_;
+
+    // Entry {i, j, outer[i] * inner[j]}
+    // Since the order is multiplicative, each row i is produced in order as j increases
+    struct HeapEntry {
+        size_t i, j;
+        MononodeId m;
+    };
+    auto product = [this, &outer, &inner](const size_t i, const size_t j) {
+        return HeapEntry{i, j, (*node_store_.get_mononode(outer[i].first) 
+                * *node_store_.get_mononode(inner[j].first))->id};
+    };
+    // std heaps put the largest first, so the leading mononode must compare as the largest
+    auto heap_cmp = [&node_store = node_store_](const HeapEntry& lhs, const HeapEntry& rhs) {
+        return node_store.mononode_cmp(lhs.m, rhs.m) > 0;
+    };
+
+    std::vector<HeapEntry> heap;
+    if (!inner.empty()) {
+        heap.reserve(outer.size());
+        for (size_t i = 0; i < outer.size(); i++) heap.push_back(product(i, 0));
+        std::make_heap(heap.begin(), heap.end(), heap_cmp);
     }
 
-    std::vector<std::pair<MononodeHash, R>> combined_summands_vec;
-    combined_summands_vec.reserve(combined_summands.size());
+    std::vector<std::pair<MononodeId, R>> combined_summands_vec;
+    combined_summands_vec.reserve(outer.size() + inner.size());
+
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), heap_cmp);
+        const HeapEntry top = heap.back();
+        heap.pop_back();
 
-    for (auto it = combined_summands.begin(); it != combined_summands.end(); it++) {
-        if (it->second != 0) combined_summands_vec.emplace_back(std::move(*it));
+        // Combine like terms as they come out, dropping the ones that cancel
+        R c = outer[top.i].second * inner[top.j].second;
+        if (!combined_summands_vec.empty() && combined_summands_vec.back().first == top.m) {
+            combined_summands_vec.back().second += c;
+        } else {
+            if (!combined_summands_vec.empty() && combined_summands_vec.back().second == 0) {
+                combined_summands_vec.pop_back();
+            }
+            combined_summands_vec.emplace_back(top.m, std::move(c));
+        }
+
+        if (top.j + 1 < inner.size()) {
+            heap.push_back(product(top.i, top.j + 1));
+            std::push_heap(heap.begin(), heap.end(), heap_cmp);
+        }
     }
+    if (!combined_summands_vec.empty() && combined_summands_vec.back().second == 0) combined_summands_vec.pop_back();
 
-    return node_store_.insert_polynode(
-            Polynode<R>(std::move(combined_summands_vec), node_store_));
+    const Polynode<R>* prod = !homomorphic_ || !rhs.homomorphic_
+        ? node_store_.intern_polynode(std::move(combined_summands_vec))
+        : node_store_.intern_polynode(std::move(combined_summands_vec), mul_p(hash, rhs.hash), true);
+
+    node_store_.computed_.insert(CacheOp::MUL, a, b, 0, prod->id);
+    return prod;
 }
 
 // By the definition of mononomial order, we do not have to reorder
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::scale(const Mononode<R>& m, const R c) const {
-    std::vector<std::pair<MononodeHash, R>> new_summands;
+    // Nothing is interned for the key, and coefficients too large to encode are not cached at all
+    uint64_t c_key = 0;
+    const bool cacheable = node_store_.computed_.capacity() > 0 && to_cache_key(c, c_key);
+    PolynodeId cached;
+    if (cacheable && node_store_.computed_.find(CacheOp::SCALE, id, m.id, 0, cached, c_key)) {
+        return node_store_.get_polynode(cached);
+    }
+
+    std::vector<std::pair<MononodeId, R>> new_summands;
     new_summands.reserve(summands_.size());
 
-    for (const std::pair<MononodeHash, R> &entry : summands_) {
-        new_summands.emplace_back((*node_store_.get_mononode(entry.first) * m)->hash, entry.second * c);
+    for (const std::pair<MononodeId, R> &entry : summands_) {
+        new_summands.emplace_back((*node_store_.get_mononode(entry.first) * m)->id, entry.second * c);
+    }
+
+    PolynodeHash c_hash;
+    const Polynode<R>* scaled = !homomorphic_ || !to_polynode_hash(c, c_hash)
+        ? node_store_.intern_polynode(std::move(new_summands))
+        : node_store_.intern_polynode(std::move(new_summands), mul_p(mul_p(hash, m.hash), c_hash), true);
+
+    if (cacheable) node_store_.computed_.insert(CacheOp::SCALE, id, m.id, 0, scaled->id, c_key);
+    return scaled;
+}
+
+// Merges this with the products c m q as they are produced, so c m q is never built
+template<class R>
+const algebra::Polynode<R>* algebra::Polynode<R>::sub_scaled(const R c, const Mononode<R>& m, 
+        const Polynode<R>& q) const {
+    uint64_t c_key = 0;
+    const bool cacheable = node_store_.computed_.capacity() > 0 && to_cache_key(c, c_key);
+    PolynodeId cached;
+    if (cacheable && node_store_.computed_.find(CacheOp::AXPY, id, q.id, m.id, cached, c_key)) {
+        return node_store_.get_polynode(cached);
+    }
+
+    std::vector<std::pair<MononodeId, R>> combined_summands;
+    combined_summands.reserve(summands_.size() + q.summands_.size());
+
+    auto itl = begin(), itr = q.begin();
+    MononodeId mr = itr != q.end() ? (*node_store_.get_mononode(itr->first) * m)->id : 0;
+
+    // In reductions and S polynomials the leading terms cancel, skip them without any arithmetic
+    if (itl != end() && itr != q.end() && itl->first == mr && itl->second == c * itr->second) {
+        itl++;
+        if (++itr != q.end()) mr = (*node_store_.get_mononode(itr->first) * m)->id;
     }
 
-    return node_store_.insert_polynode(
-            Polynode<R>(std::move(new_summands), node_store_));
+    // Multiplying by m keeps the order of q, so this is a plain merge
+    while (itl != end() || itr != q.end()) {
+        const int cmp = itl == end() ? 1 : itr == q.end() ? -1 : node_store_.mononode_cmp(itl->first, mr);
+        if (cmp < 0) {
+            combined_summands.push_back(*itl++);
+            continue;
+        }
+
+        R coeff = -c * itr->second;
+        if (cmp == 0) coeff += (itl++)->second;
+        if (coeff != 0) combined_summands.emplace_back(mr, std::move(coeff));
+
+        if (++itr != q.end()) mr = (*node_store_.get_mononode(itr->first) * m)->id;
+    }
+
+    PolynodeHash c_hash;
+    const Polynode<R>* diff = !homomorphic_ || !q.homomorphic_ || !to_polynode_hash(c, c_hash)
+        ? node_store_.intern_polynode(std::move(combined_summands))
+        : node_store_.intern_polynode(std::move(combined_summands), 
+                add_p(hash, neg_p(mul_p(mul_p(q.hash, m.hash), c_hash))), true);
+
+    if (cacheable) node_store_.computed_.insert(CacheOp::AXPY, id, q.id, m.id, diff->id, c_key);
+    return diff;
 }
 
 template<class R>
@@ -765,165 +1279,55 @@ const R algebra::Polynode<R>::leading_c() const {
 }
 
 template<class R>
-typename std::vector<std::pair<algebra::MononodeHash, R>>::const_iterator algebra::Polynode<R>::begin() 
+typename std::vector<std::pair<algebra::MononodeId, R>>::const_iterator algebra::Polynode<R>::begin() 
     const { return summands_.begin(); }
 
 template<class R>
-typename std::vector<std::pair<algebra::MononodeHash, R>>::const_iterator algebra::Polynode<R>::end() 
+typename std::vector<std::pair<algebra::MononodeId, R>>::const_iterator algebra::Polynode<R>::end() 
     const { return summands_.end(); }
 
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::sub(const Idx var, const Polynode<R>& val) const {
-    // It is likely not a repeat, so we do not compute the hash first
-    const Polynode<R>* sum = node_store_.zero_p();
-    for (const std::pair<MononodeHash, R> &entry : summands_) {
-        const Polynode<R>* term = node_store_.one_p();
-        std::unordered_map<NodeHash, int> non_sub_factors{};
-
-        // Pretty costly, but we'll just multiply everything together for now
-        for (const std::pair<const NodeHash, int> &factor : *node_store_.get_mononode(entry.first)) { 
-            const Node<R>* nptr = node_store_.get_node(factor.first);
-            switch (nptr->type_) {
-                // If it is the correct variable, substitute
-                case NodeType::VAR: {
-                    if (nptr->var_ == var) {
-                        for (int rep = 0; rep < factor.second; rep++) {
-                            term = *term * val; // Slow, but it's probably ok because exponents are small
-                        }
-                    } else {
-                        non_sub_factors[factor.first] += factor.second;
-                    }
-                    break;
-                }
-                // If it is f(polynode), then we need to recursively substitute inside the entire polynode
-                case NodeType::POL: {
-                    non_sub_factors[node_store_.node
-                            (node_store_.get_polynode(
-                                node_store_.get_node(factor.first)->pol_
-                            )->sub(var, val)->hash
-                        )->hash] += factor.second;
-                    break;
-                }
-            }
-        }
-        term = *term * 
-                *node_store_.polynode(
-                    {{node_store_.mononode(std::move(non_sub_factors))->hash, entry.second}}
-                );
+    PolynodeId cached;
+    if (node_store_.computed_.find(CacheOp::SUB, id, val.id, Id(var), cached)) return node_store_.get_polynode(cached);
 
-        sum = *sum + *term;
-    }
-    return sum;
+    const Polynode<R>* res = Substituter<R>(node_store_, {{var, &val}}).apply(*this);
+
+    node_store_.computed_.insert(CacheOp::SUB, id, val.id, Id(var), res->id);
+    return res;
 }
 
-// We do not assume that the order remains after subbing for zeros
-// TODO: can we get rid of this?
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::subs_zero(const std::unordered_set<Idx>& vars) const {
-    std::map<MononodeHash, R, std::function<bool(const MononodeHash, const MononodeHash)>> 
-        new_summands([&node_store = node_store_] (const MononodeHash lhs, const MononodeHash rhs) {
-                    return node_store.mononode_cmp(lhs, rhs) < 0;
-                });
+    std::unordered_map<Idx, const Polynode<R>*> replace;
+    replace.reserve(vars.size());
+    for (const Idx var : vars) replace.emplace(var, node_store_.zero_p());
 
-    for (const std::pair<MononodeHash, R> &entry : summands_) {
-        // Is one of the summands zero? If yes, we can just early break
-        bool is_zero = false;
-        std::unordered_map<NodeHash, int> factors;
-        factors.reserve(node_store_.get_mononode(entry.first)->factors_.size());
-
-        for (const std::pair<const NodeHash, int> &factor : *node_store_.get_mononode(entry.first)) { 
-            const Node<R>* nptr = node_store_.get_node(factor.first);
-            switch (nptr->type_) {
-                case NodeType::VAR: {
-                    if (vars.find(nptr->var_) != vars.end()) {
-                        is_zero = true;
-                    } else {
-                        factors[factor.first] += factor.second;
-                    }
-                    break;
-                }
-                // If it is f(polynode), then we need to recursively substitute inside the entire polynode
-                case NodeType::POL: {
-                    factors[node_store_.node
-                            (node_store_.get_polynode(
-                                node_store_.get_node(factor.first)->pol_
-                            )->subs_zero(vars)->hash
-                        )->hash] += factor.second;
-                    break;
-                }
-            }
-            if (is_zero) break;
-        }
-        if (is_zero) continue;
-
-        new_summands[node_store_.mononode(std::move(factors))->hash] += entry.second;
-    }
-    std::vector<std::pair<MononodeHash, R>> new_summands_vec;
-    new_summands_vec.reserve(new_summands.size());
-
-    for (auto it = new_summands.begin(); it != new_summands.end(); it++) {
-        if (it->second != 0) new_summands_vec.emplace_back(std::move(*it));
-    }
-
-    return node_store_.insert_polynode(Polynode<R>(std::move(new_summands_vec), node_store_));
+    return Substituter<R>(node_store_, std::move(replace)).apply(*this);
 }
 
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::subs_var(const std::unordered_map<Idx, Idx>& replace) const {
-    std::map<MononodeHash, R, std::function<bool(const MononodeHash, const MononodeHash)>> 
-        new_summands([&node_store = node_store_] (const MononodeHash lhs, const MononodeHash rhs) {
-                    return node_store.mononode_cmp(lhs, rhs) < 0;
-                });
-
-    for (const std::pair<MononodeHash, R> &entry : summands_) {
-        std::unordered_map<NodeHash, int> factors;
-        factors.reserve(node_store_.get_mononode(entry.first)->factors_.size());
-
-        for (const std::pair<const NodeHash, int> &factor : *node_store_.get_mononode(entry.first)) { 
-            const Node<R>* nptr = node_store_.get_node(factor.first);
-            switch (nptr->type_) {
-                case NodeType::VAR: {
-                    auto it = replace.find(nptr->var_);
-                    if (it != replace.end()) {
-                        factors[node_store_.node(it->second)->hash] += factor.second;
-                    } else {
-                        factors[factor.first] += factor.second;
-                    }
-                    break;
-                }
-                // If it is f(polynode), then we need to recursively substitute inside the entire polynode
-                case NodeType::POL: {
-                    factors[node_store_.node
-                            (node_store_.get_polynode(
-                                node_store_.get_node(factor.first)->pol_
-                            )->subs_var(replace)->hash
-                        )->hash] += factor.second;
-                    break;
-                }
-
-            }
-        }
-        new_summands[node_store_.mononode(std::move(factors))->hash] += entry.second;
+    std::unordered_map<Idx, const Polynode<R>*> vals;
+    vals.reserve(replace.size());
+    for (const std::pair<const Idx, Idx> &entry : replace) {
+        vals.emplace(entry.first, node_store_.polynode({
+                    {node_store_.mononode({{node_store_.node(entry.second)->id, 1}})->id, 1}
+                }));
     }
-    std::vector<std::pair<MononodeHash, R>> new_summands_vec;
-    new_summands_vec.reserve(new_summands.size());
 
-    for (auto it = new_summands.begin(); it != new_summands.end(); it++) {
-        if (it->second != 0) new_summands_vec.emplace_back(std::move(*it));
-    }
-
-    return node_store_.insert_polynode(Polynode<R>(std::move(new_summands_vec), node_store_));
+    return Substituter<R>(node_store_, std::move(vals)).apply(*this);
 }
 
 template<class R>
 const algebra::Polynode<R>* algebra::Polynode<R>::apply_func(const Polynode<R>& rhs) const {
     return node_store_.polynode({
             {node_store_.mononode({
-                    {node_store_.node((*this + rhs)->hash)->hash, 1}
-                })->hash, 1},
+                    {node_store_.node((*this + rhs)->id)->id, 1}
+                })->id, 1},
             {node_store_.mononode({ 
-                    {node_store_.node(rhs.hash)->hash, 1}
-                })->hash, -1}
+                    {node_store_.node(rhs.id)->id, 1}
+                })->id, -1}
         });
 }
 
@@ -938,3 +1342,13 @@ template class algebra::NodeStore<mpq_class>;
 template class algebra::Node<mpq_class>;
 template class algebra::Mononode<mpq_class>;
 template class algebra::Polynode<mpq_class>;
+
+template class algebra::NodeStore<coeff::ModP>;
+template class algebra::Node<coeff::ModP>;
+template class algebra::Mononode<coeff::ModP>;
+template class algebra::Polynode<coeff::ModP>;
+
+template class algebra::NodeStore<coeff::SmallQ>;
+template class algebra::Node<coeff::SmallQ>;
+template class algebra::Mononode<coeff::SmallQ>;
+template class algebra::Polynode<coeff::SmallQ>;
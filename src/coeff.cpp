@@ -0,0 +1,192 @@
+#include "../include/coeff.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <numeric>
+#include <stdexcept>
+
+#include <gmpxx.h>
+
+thread_local uint32_t coeff::ModP::p_ = coeff::ModP::DEFAULT_PRIME;
+
+void coeff::ModP::set_prime(const uint32_t p) {
+    if (p <= 2 || p >= (uint32_t(1) << 31)) {
+        throw std::invalid_argument("Prime " + std::to_string(p) + " is out of range (2, 2^31)");
+    }
+    p_ = p;
+}
+
+// Extended Euclid on machine words, much cheaper than the p - 2 multiplications of Fermat
+coeff::ModP coeff::ModP::inverse() const {
+    if (v_ == 0) throw std::domain_error("Division by zero mod " + std::to_string(p_));
+
+    int64_t t = 0, new_t = 1;
+    uint32_t r = p_, new_r = v_;
+    while (new_r != 0) {
+        const uint32_t q = r / new_r;
+
+        const int64_t tmp_t = t - int64_t(q) * new_t;
+        t = new_t;
+        new_t = tmp_t;
+
+        const uint32_t tmp_r = r - q * new_r;
+        r = new_r;
+        new_r = tmp_r;
+    }
+    return ModP(uint32_t(t < 0 ? t + p_ : t), Raw());
+}
+
+// Runs Euclid on (p, v) and stops at the first remainder below the bound, see Wang's algorithm
+bool coeff::ModP::rational(int64_t &num, int64_t &den) const {
+    const int64_t bound = int64_t(std::sqrt(double(p_) / 2));
+
+    int64_t r0 = p_, r1 = v_, t0 = 0, t1 = 1;
+    while (r1 > bound) {
+        const int64_t q = r0 / r1;
+
+        const int64_t r2 = r0 - q * r1;
+        r0 = r1;
+        r1 = r2;
+
+        const int64_t t2 = t0 - q * t1;
+        t0 = t1;
+        t1 = t2;
+    }
+    if (t1 == 0 || std::abs(t1) > bound || std::gcd(r1, t1) != 1) return false;
+
+    num = t1 < 0 ? -r1 : r1;
+    den = std::abs(t1);
+    return true;
+}
+
+int coeff::ModP::sign() const {
+    int64_t num, den;
+    const int64_t v = rational(num, den) ? num : signed_value();
+    return (v > 0) - (v < 0);
+}
+
+std::string coeff::to_string(const ModP& x) {
+    int64_t num, den;
+    if (!x.rational(num, den)) return std::to_string(x.signed_value());
+    return den == 1 ? std::to_string(num) : std::to_string(num) + "/" + std::to_string(den);
+}
+
+coeff::ModP coeff::parse_mod_p(const std::string& input) {
+    // mpq_class does not accept a leading +
+    mpq_class q(!input.empty() && input[0] == '+' ? input.substr(1) : input);
+    q.canonicalize();
+
+    const uint32_t p = ModP::prime();
+    const ModP den(int64_t(mpz_fdiv_ui(q.get_den_mpz_t(), p)));
+    if (den == 0) {
+        throw std::invalid_argument("Denominator of '" + input + "' is divisible by " + std::to_string(p));
+    }
+    return ModP(int64_t(mpz_fdiv_ui(q.get_num_mpz_t(), p))) / den;
+}
+
+coeff::SmallQ::SmallQ(const int64_t num, const int64_t den) : SmallQ() {
+    if (den == 0) throw std::domain_error("Zero denominator");
+
+    if (num >= MIN && den >= MIN) {
+        const int64_t g = std::gcd(num, den);
+        num_ = den < 0 ? -num / g : num / g;
+        den_ = den < 0 ? -den / g : den / g;
+        return;
+    }
+    mpq_class q{mpz_class(num), mpz_class(den)};
+    q.canonicalize();
+    assign(std::move(q));
+}
+
+void coeff::SmallQ::assign(mpq_class&& q) {
+    if (mpz_fits_slong_p(q.get_num_mpz_t()) && mpz_fits_slong_p(q.get_den_mpz_t()) 
+            && q.get_num().get_si() >= MIN) {
+        num_ = q.get_num().get_si();
+        den_ = q.get_den().get_si();
+        delete big_;
+        big_ = nullptr;
+    } else if (big_ == nullptr) {
+        big_ = new mpq_class(std::move(q));
+    } else {
+        *big_ = std::move(q);
+    }
+}
+
+// Henrici's addition, the gcds keep the intermediate products as small as they can be
+bool coeff::SmallQ::add_small(const SmallQ& rhs) {
+    int64_t num, den;
+    if (den_ == rhs.den_) {
+        if (__builtin_add_overflow(num_, rhs.num_, &num) || num < MIN) return false;
+        const int64_t g = std::gcd(num, den_);
+        num_ = num / g;
+        den_ = den_ / g;
+        return true;
+    }
+
+    const int64_t g = std::gcd(den_, rhs.den_);
+    int64_t lhs_part, rhs_part;
+    if (__builtin_mul_overflow(num_, rhs.den_ / g, &lhs_part) 
+            || __builtin_mul_overflow(rhs.num_, den_ / g, &rhs_part)
+            || __builtin_add_overflow(lhs_part, rhs_part, &num) || num < MIN) {
+        return false;
+    }
+
+    if (num == 0) {
+        num_ = 0;
+        den_ = 1;
+        return true;
+    }
+
+    const int64_t g2 = std::gcd(num, g);
+    if (__builtin_mul_overflow(den_ / g, rhs.den_ / g2, &den)) return false;
+    num_ = num / g2;
+    den_ = den;
+    return true;
+}
+
+bool coeff::SmallQ::mul_small(const SmallQ& rhs) {
+    // Zero is 0/1, so this stays canonical when either one is zero
+    const int64_t g1 = std::gcd(num_, rhs.den_), g2 = std::gcd(rhs.num_, den_);
+
+    int64_t num, den;
+    if (__builtin_mul_overflow(num_ / g1, rhs.num_ / g2, &num) || num < MIN
+            || __builtin_mul_overflow(den_ / g2, rhs.den_ / g1, &den)) {
+        return false;
+    }
+    num_ = num;
+    den_ = den;
+    return true;
+}
+
+coeff::SmallQ& coeff::SmallQ::operator/=(const SmallQ& rhs) {
+    if (rhs.sign() == 0) throw std::domain_error("Division by zero");
+
+    if (rhs.big_ == nullptr) {
+        // rhs.num_ >= MIN, so the inverse is small too
+        SmallQ inv;
+        inv.num_ = rhs.num_ < 0 ? -rhs.den_ : rhs.den_;
+        inv.den_ = rhs.num_ < 0 ? -rhs.num_ : rhs.num_;
+        return *this *= inv;
+    }
+    assign(get_mpq() / *rhs.big_);
+    return *this;
+}
+
+coeff::SmallQ coeff::SmallQ::operator-() const {
+    if (big_ != nullptr) return SmallQ(mpq_class(-*big_));
+
+    SmallQ res;
+    res.num_ = -num_;
+    res.den_ = den_;
+    return res;
+}
+
+mpq_class coeff::SmallQ::get_mpq() const {
+    if (big_ != nullptr) return *big_;
+    return mpq_class(mpz_class(num_), mpz_class(den_)); // Already canonical
+}
+
+std::string coeff::to_string(const SmallQ& x) {
+    if (!x.is_small()) return x.get_mpq().get_str();
+    return x.den() == 1 ? std::to_string(x.num()) : std::to_string(x.num()) + "/" + std::to_string(x.den());
+}
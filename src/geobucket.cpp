@@ -0,0 +1,150 @@
+#include "../include/geobucket.hpp"
+#include "../include/coeff.hpp"
+
+#include <algorithm>
+#include <iterator>
+
+#include <gmpxx.h>
+
+template<class R>
+algebra::Geobucket<R>::Geobucket(NodeStore<R> &node_store) : node_store_(node_store) {}
+
+template<class R>
+algebra::Geobucket<R>::Geobucket(NodeStore<R> &node_store, const Polynode<R> &p) : node_store_(node_store) {
+    add(Terms(std::make_reverse_iterator(p.end()), std::make_reverse_iterator(p.begin())));
+}
+
+template<class R>
+typename algebra::Geobucket<R>::Terms algebra::Geobucket<R>::merge(Terms&& lhs, Terms&& rhs) const {
+    if (lhs.empty()) return std::move(rhs);
+    if (rhs.empty()) return std::move(lhs);
+
+    Terms res;
+    res.reserve(lhs.size() + rhs.size());
+
+    // Both are sorted with the leading term at the back, so the front is the smallest
+    auto itl = lhs.begin(), itr = rhs.begin();
+    while (itl != lhs.end() && itr != rhs.end()) {
+        const int cmp = node_store_.mononode_cmp(itl->first, itr->first);
+        if (cmp > 0) {
+            res.push_back(std::move(*itl++));
+        } else if (cmp < 0) {
+            res.push_back(std::move(*itr++));
+        } else {
+            itl->second += itr->second;
+            if (itl->second != 0) res.push_back(std::move(*itl));
+            itl++; itr++;
+        }
+    }
+    std::move(itl, lhs.end(), std::back_inserter(res));
+    std::move(itr, rhs.end(), std::back_inserter(res));
+    return res;
+}
+
+template<class R>
+void algebra::Geobucket<R>::add(Terms&& terms) {
+    size_t k = 0;
+    while (capacity(k) < terms.size()) k++;
+
+    for (;; k++) {
+        if (buckets_.size() <= k) buckets_.resize(k + 1);
+
+        terms = merge(std::move(buckets_[k]), std::move(terms));
+        buckets_[k].clear();
+        if (terms.size() <= capacity(k)) {
+            buckets_[k] = std::move(terms);
+            return;
+        }
+    }
+}
+
+template<class R>
+typename algebra::Geobucket<R>::Terms* algebra::Geobucket<R>::lead_bucket() {
+    for (;;) {
+        // Find the bucket with the leading term
+        Terms* lead = nullptr;
+        for (Terms &bucket : buckets_) {
+            if (bucket.empty()) continue;
+            if (lead == nullptr || node_store_.mononode_cmp(bucket.back().first, lead->back().first) < 0) {
+                lead = &bucket;
+            }
+        }
+        if (lead == nullptr) return nullptr;
+
+        // Gather the same mononode from every other bucket
+        for (Terms &bucket : buckets_) {
+            if (&bucket == lead || bucket.empty() || bucket.back().first != lead->back().first) continue;
+            lead->back().second += bucket.back().second;
+            bucket.pop_back();
+        }
+
+        if (lead->back().second != 0) return lead;
+        lead->pop_back();
+    }
+}
+
+template<class R>
+const std::pair<algebra::MononodeId, R>* algebra::Geobucket<R>::leading() {
+    Terms* lead = lead_bucket();
+    return lead == nullptr ? nullptr : &lead->back();
+}
+
+template<class R>
+void algebra::Geobucket<R>::add_scaled(const R &c, const Mononode<R> &m, const Polynode<R> &p) {
+    // Multiplying by a mononode keeps the order
+    Terms terms;
+    terms.reserve(p.end() - p.begin());
+    for (auto it = std::make_reverse_iterator(p.end()); it != std::make_reverse_iterator(p.begin()); it++) {
+        terms.emplace_back((*node_store_.get_mononode(it->first) * m)->id, c * it->second);
+    }
+    add(std::move(terms));
+}
+
+template<class R>
+void algebra::Geobucket<R>::scale(const R &c) {
+    if (c == 1) return;
+    for (Terms &bucket : buckets_) {
+        for (std::pair<MononodeId, R> &term : bucket) term.second *= c;
+    }
+}
+
+template<class R>
+void algebra::Geobucket<R>::cancel_leading(const R &c, const Mononode<R> &m, const Polynode<R> &p) {
+    // The leading terms cancel by assumption, so neither is computed
+    Terms* lead = lead_bucket();
+    if (lead != nullptr) lead->pop_back();
+    if (p.begin() == p.end()) return;
+
+    Terms terms;
+    terms.reserve(p.end() - p.begin());
+    for (auto it = std::make_reverse_iterator(p.end()); it != std::make_reverse_iterator(p.begin() + 1); it++) {
+        terms.emplace_back((*node_store_.get_mononode(it->first) * m)->id, c * it->second);
+    }
+    add(std::move(terms));
+}
+
+template<class R>
+const typename algebra::Geobucket<R>::Terms& algebra::Geobucket<R>::normalize() {
+    Terms all;
+    for (Terms &bucket : buckets_) {
+        all = merge(std::move(all), std::move(bucket));
+        bucket.clear();
+    }
+
+    size_t k = 0;
+    while (capacity(k) < all.size()) k++;
+    if (buckets_.size() <= k) buckets_.resize(k + 1);
+    buckets_[k] = std::move(all);
+    return buckets_[k];
+}
+
+template<class R>
+const algebra::Polynode<R>* algebra::Geobucket<R>::to_polynode() {
+    const Terms &terms = normalize();
+    return node_store_.intern_polynode(Terms(terms.rbegin(), terms.rend()));
+}
+
+//template class algebra::Geobucket<int>;
+template class algebra::Geobucket<mpq_class>;
+template class algebra::Geobucket<coeff::ModP>;
+template class algebra::Geobucket<coeff::SmallQ>;
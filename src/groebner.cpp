@@ -1,8 +1,14 @@
 #include "../include/groebner.hpp"
+#include "../include/coeff.hpp"
+#include "../include/kernels.hpp"
 
+#include <algorithm>
 #include <iostream>
-#include <vector>
+#include <numeric>
 #include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 std::chrono::time_point<std::chrono::system_clock> now() {
     return std::chrono::system_clock::now();
@@ -10,29 +16,96 @@ std::chrono::time_point<std::chrono::system_clock> now() {
 
 template<class R>
 groebner::Reducer<R>::Reducer(std::vector<groebner::Poly<R>*> polys, 
-        algebra::NodeStore<R> &node_store) : polys_(polys), node_store_(node_store) {}
+        algebra::NodeStore<R> &node_store, size_t gc_threshold, bool fraction_free, bool f4) : 
+    polys_(polys), node_store_(node_store), gc_threshold_(gc_threshold), fraction_free_(fraction_free), f4_(f4) {}
+
+// The gcd of a and b as rationals: the gcd of the numerators over the lcm of the denominators,
+// so that a and b divided by it are coprime integers
+// A field has no such thing, and anything nonzero will do
+template<class R>
+R coeff_gcd(const R &, const R &) {
+    return 1;
+}
+
+template<>
+mpq_class coeff_gcd(const mpq_class &a, const mpq_class &b) {
+    // Canonical as is, a prime in both would divide a numerator and its denominator
+    return mpq_class(gcd(a.get_num(), b.get_num()), lcm(a.get_den(), b.get_den()));
+}
+
+template<>
+coeff::SmallQ coeff_gcd(const coeff::SmallQ &a, const coeff::SmallQ &b) {
+    int64_t den;
+    if (a.is_small() && b.is_small()
+            && !__builtin_mul_overflow(a.den() / std::gcd(a.den(), b.den()), b.den(), &den)) {
+        return coeff::SmallQ(std::gcd(a.num(), b.num()), den);
+    }
+    return coeff_gcd(a.get_mpq(), b.get_mpq());
+}
+
+// The gcd of every coefficient
+// Over Q it can still drop below 1, by a denominator, so there is no early exit
+template<class R, class Iter>
+R content(Iter begin, Iter end) {
+    if (begin == end) return 1;
+
+    R g = begin->second;
+    for (Iter it = begin + 1; it != end; it++) g = coeff_gcd(g, it->second);
+    return abs(g);
+}
+
+template<class R>
+groebner::Poly<R>* groebner::Reducer<R>::make_primitive(Poly<R>* p) {
+    const R c = content<R>(p->begin(), p->end());
+    return c == 1 ? p : p->scale(*node_store_.one_m(), 1 / c);
+}
+
+template<class R>
+void groebner::Reducer<R>::make_primitive(algebra::Geobucket<R> &p) {
+    const std::vector<std::pair<algebra::MononodeId, R>> &terms = p.normalize();
+    const R c = content<R>(terms.begin(), terms.end());
+    if (c != 1) p.scale(1 / c);
+}
 
 template<class R>
 groebner::Poly<R>* groebner::Reducer<R>::S_poly(Poly<R>* p1, Poly<R>* p2) {
     std::pair<Mono<R>*, Mono<R>*> sym_q = p1->leading_m()->symmetric_q(*p2->leading_m());
+
+    // Cross multiply instead of dividing by the leading coefficients
+    if (fraction_free_) {
+        const R g = coeff_gcd(p1->leading_c(), p2->leading_c());
+        return make_primitive(p1->scale(*sym_q.first, p2->leading_c() / g)
+                ->sub_scaled(p1->leading_c() / g, *sym_q.second, *p2));
+    }
     
-    auto S=*p1->scale(*sym_q.first , 1 / p1->leading_c()) 
-         - *p2->scale(*sym_q.second, 1 / p2->leading_c());
+    auto S = p1->scale(*sym_q.first, 1 / p1->leading_c())
+        ->sub_scaled(1 / p2->leading_c(), *sym_q.second, *p2);
 
     return S;
 }
 
 // Returns true if p was lead reduced
+// Fraction free, p is first scaled so that no division is needed
 template<class R>
-bool try_lead_reduce(groebner::Poly<R>* &p, const groebner::PolyIter<R> &it, algebra::NodeStore<R> &node_store) {
-    if (*p == *node_store.zero_p()) {
+bool try_lead_reduce(algebra::Geobucket<R> &p, const groebner::PolyIter<R> &it, algebra::NodeStore<R> &node_store,
+        const bool fraction_free) {
+    const std::pair<algebra::MononodeId, R>* lead = p.leading();
+    if (lead == nullptr) {
         return false;
     }
 
     // If the leading monomial of p is divisible by the leading monomial of *it, then subtract
-    if (p->leading_m()->divisible(*(*it)->leading_m())) {
-        std::pair<groebner::Mono<R>*, groebner::Mono<R>*> sym_q = p->leading_m()->symmetric_q(*(*it)->leading_m());
-        p = *p + *(*it)->scale(*sym_q.second, -p->leading_c() / (*it)->leading_c());
+    groebner::Mono<R>* m = node_store.get_mononode(lead->first);
+    if (m->divisible(*(*it)->leading_m())) {
+        groebner::Mono<R>* q = *m / *(*it)->leading_m();
+        if (fraction_free) {
+            const R g = coeff_gcd(lead->second, (*it)->leading_c());
+            const R c = -lead->second / g;
+            p.scale((*it)->leading_c() / g);
+            p.cancel_leading(c, *q, **it);
+        } else {
+            p.cancel_leading(-lead->second / (*it)->leading_c(), *q, **it);
+        }
 
         return true;
     }
@@ -40,41 +113,50 @@ bool try_lead_reduce(groebner::Poly<R>* &p, const groebner::PolyIter<R> &it, alg
 }
 
 template<class R>
-groebner::Poly<R>* groebner::Reducer<R>::lead_reduce(Poly<R>* p, const PolyIter<R> &b_start, const PolyIter<R> &b_end) {
+groebner::Poly<R>* groebner::Reducer<R>::lead_reduce(Poly<R>* p_in, const PolyIter<R> &b_start, const PolyIter<R> &b_end) {
+    // Work on an uninterned copy, only the result is interned
+    algebra::Geobucket<R> p(node_store_, *p_in);
+
     bool reduced = false;
     //int rep = 0;
     while (!reduced && !(stop_ && now() > stop_time_)) {
         reduced = true;
 
         for (PolyIter<R> it = b_start; it != b_end; it++) {
-            if (try_lead_reduce(p, it, node_store_)) {
+            if (try_lead_reduce(p, it, node_store_, fraction_free_)) {
                 reduced = false;
             }
         }
+        if (fraction_free_ && !reduced) make_primitive(p);
         //rep++;
     }
     //std::cout << "Done in " << rep << " repetitions" << std::endl;
-    return p;
+    return p.to_polynode();
 }
 
 // Returns true if p was reduced
 template<class R>
-bool try_reduce(groebner::Poly<R>* &p, const groebner::PolyIter<R> &it, algebra::NodeStore<R> &node_store) {
-    if (*p == *node_store.zero_p()) {
-        return false;
-    }
-
+bool try_reduce(algebra::Geobucket<R> &p, const groebner::PolyIter<R> &it, algebra::NodeStore<R> &node_store,
+        const bool fraction_free) {
     // TODO:
     // Probably ends up being Schlemiel the painter 
     // (if nothing up to term n can be reduced the first itoration, it doesn't change the next)
     // but that's ok for now
-    for (const std::pair<algebra::MononodeHash, R> &term : *p) {
-        groebner::Mono<R>* m = node_store.get_mononode(term.first);
+    const std::vector<std::pair<algebra::MononodeId, R>> &terms = p.normalize();
+    for (auto term = terms.rbegin(); term != terms.rend(); term++) {
+        groebner::Mono<R>* m = node_store.get_mononode(term->first);
 
         // If some monomial of p is divisible by the leading monomial of *it, then subtract
         if (m->divisible(*(*it)->leading_m())) {
-            std::pair<groebner::Mono<R>*, groebner::Mono<R>*> sym_q = m->symmetric_q(*(*it)->leading_m());
-            p = *p + *(*it)->scale(*sym_q.second, -term.second / (*it)->leading_c());
+            groebner::Mono<R>* q = *m / *(*it)->leading_m();
+            if (fraction_free) {
+                const R g = coeff_gcd(term->second, (*it)->leading_c());
+                const R c = -term->second / g;
+                p.scale((*it)->leading_c() / g);
+                p.add_scaled(c, *q, **it);
+            } else {
+                p.add_scaled(-term->second / (*it)->leading_c(), *q, **it);
+            }
 
             return true;
         }
@@ -83,26 +165,41 @@ bool try_reduce(groebner::Poly<R>* &p, const groebner::PolyIter<R> &it, algebra:
 }
 
 template<class R>
-groebner::Poly<R>* groebner::Reducer<R>::reduce(Poly<R>* p, 
+groebner::Poly<R>* groebner::Reducer<R>::reduce(Poly<R>* p_in, 
         const PolyIter<R> &b_start, const PolyIter<R> &b_end, 
         const PolyIter<R> &b_start2, const PolyIter<R> &b_end2) {
+    algebra::Geobucket<R> p(node_store_, *p_in);
+
     bool reduced = false;
     while (!reduced && !(stop_ && now() > stop_time_)) {
         reduced = true;
 
         for (PolyIter<R> it = b_start; it != b_end; it++) {
-            if (try_reduce(p, it, node_store_)) {
+            if (try_reduce(p, it, node_store_, fraction_free_)) {
                 reduced = false;
             }
         }
 
         for (PolyIter<R> it = b_start2; it != b_end2; it++) {
-            if (try_reduce(p, it, node_store_)) {
+            if (try_reduce(p, it, node_store_, fraction_free_)) {
                 reduced = false;
             }
         }
+        if (fraction_free_ && !reduced) make_primitive(p);
     }
-    return p;
+    return p.to_polynode();
+}
+
+template<class R>
+void groebner::Reducer<R>::collect_garbage(const std::vector<algebra::MononodeId> &mononode_roots) {
+    std::vector<algebra::PolynodeId> roots;
+    roots.reserve(polys_.size());
+    for (Poly<R>* p : polys_) roots.push_back(p->id);
+
+    node_store_.collect(roots, mononode_roots);
+
+    // Amortize: the next collection waits until the survivors have at least doubled
+    gc_threshold_ = std::max(gc_threshold_, 2 * node_store_.get_polynode_store_size());
 }
 
 // Basic implementation of Buchberger's algorithm
@@ -112,9 +209,13 @@ bool groebner::Reducer<R>::calculate_gbasis() {
     if (polys_.empty()) return true;
     int len = polys_.size();
 
+    if (fraction_free_) {
+        for (Poly<R>* &p : polys_) p = make_primitive(p);
+    }
+
     // LCMs of leading mononodes
     // lm_lcms[i][j] = lcm(gen[i]->leading_m(), gen[j]->leading_m()) for i < j
-    std::vector<std::vector<algebra::MononodeHash>> lm_lcms; 
+    std::vector<std::vector<algebra::MononodeId>> lm_lcms; 
     std::vector<std::vector<bool>> S_computed; 
 
     // pq stores all pairs that are still being considered, 
@@ -136,12 +237,21 @@ bool groebner::Reducer<R>::calculate_gbasis() {
         lm_lcms[i].reserve(i);
         S_computed[i].resize(i);
         for (int j = 0; j < i; j++) {
-            lm_lcms[i].push_back(polys_[i]->leading_m()->lcm(*polys_[j]->leading_m())->hash);
+            lm_lcms[i].push_back(polys_[i]->leading_m()->lcm(*polys_[j]->leading_m())->id);
             pq.push({i, j});
         }
     }
 
     while (!pq.empty() && !(stop_ && now() > stop_time_)) {
+        // Everything else from previous iterations is garbage
+        if (node_store_.get_polynode_store_size() > gc_threshold_) {
+            std::vector<algebra::MononodeId> mononode_roots;
+            for (const std::vector<algebra::MononodeId> &row : lm_lcms) {
+                mononode_roots.insert(mononode_roots.end(), row.begin(), row.end());
+            }
+            collect_garbage(mononode_roots);
+        }
+
         std::pair<int, int> ij = pq.top();
         pq.pop();
         
@@ -188,7 +298,7 @@ bool groebner::Reducer<R>::calculate_gbasis() {
 
             const algebra::Mononode<R> *S_lm = S_red->leading_m();
             for (int k = 0; k < len; k++) {
-                lm_lcms[len].push_back(polys_[k]->leading_m()->lcm(*S_lm)->hash);
+                lm_lcms[len].push_back(polys_[k]->leading_m()->lcm(*S_lm)->id);
                 pq.push({len, k});
             }
             polys_.push_back(S_red);
@@ -199,12 +309,305 @@ bool groebner::Reducer<R>::calculate_gbasis() {
     return !(stop_ && now() > stop_time_);
 }
 
+// A row of a Macaulay matrix: a basis element times a mononode, as sparse (column, coefficient)s
+template<class R>
+using Row = std::vector<std::pair<uint32_t, R>>;
+
+// Monic rows in row echelon form, by leading column
+template<class R>
+class Echelon {
+private:
+    std::vector<Row<R>> pivots_;
+    std::vector<R> dense_;
+
+public:
+    Echelon(const size_t columns) : pivots_(columns), dense_(columns, 0) {}
+
+    // The row must lead with a column that no pivot leads with
+    void add_pivot(Row<R> row) {
+        const R lc = row.front().second;
+        for (std::pair<uint32_t, R> &entry : row) entry.second /= lc;
+        const uint32_t lead = row.front().first;
+        pivots_[lead] = std::move(row);
+    }
+
+    // Eliminates every column of row with a pivot, left to right, and adds whatever is left as a pivot
+    // Returns whether anything was left, and its leading column
+    bool reduce(const Row<R> &row, uint32_t &lead) {
+        for (const std::pair<uint32_t, R> &entry : row) dense_[entry.first] = entry.second;
+        Row<R> reduced;
+        for (uint32_t c = row.front().first; c < dense_.size(); c++) {
+            if (dense_[c] == 0) continue;
+            if (pivots_[c].empty()) {
+                reduced.emplace_back(c, dense_[c]);
+            } else {
+                const R f = dense_[c];
+                for (const std::pair<uint32_t, R> &entry : pivots_[c]) dense_[entry.first] -= f * entry.second;
+            }
+            dense_[c] = 0;
+        }
+        if (reduced.empty()) return false;
+
+        lead = reduced.front().first;
+        add_pivot(std::move(reduced));
+        return true;
+    }
+
+    Row<R> pivot(const uint32_t c) const { return pivots_[c]; }
+};
+
+// Over Z/p the rows are reduced in 64-bit accumulators by the kernels of kernels.hpp.
+// A pivot is also kept dense from its first to its last column when at least half of that is nonzero,
+// so that the vectorized kernel applies
+template<>
+class Echelon<coeff::ModP> {
+private:
+    struct Pivot {
+        std::vector<uint32_t> cols;
+        std::vector<uint32_t> vals;
+        std::vector<uint32_t> dense; // Empty if too sparse
+    };
+
+    std::vector<Pivot> pivots_;
+    std::vector<uint64_t> acc_;
+
+    const uint32_t p_;
+    const uint64_t fold_;
+    const coeff::Isa isa_;
+
+    void add_pivot(const uint32_t lead, std::vector<uint32_t> &&cols, std::vector<uint32_t> &&vals) {
+        const coeff::ModP inv = coeff::ModP(int64_t(vals.front())).inverse();
+        for (uint32_t &v : vals) v = uint32_t(uint64_t(v) * inv.value() % p_);
+
+        Pivot &pivot = pivots_[lead];
+        const size_t span = cols.back() - cols.front() + 1;
+        if (2 * cols.size() >= span) {
+            pivot.dense.assign(span, 0);
+            for (size_t i = 0; i < cols.size(); i++) pivot.dense[cols[i] - lead] = vals[i];
+        }
+        pivot.cols = std::move(cols);
+        pivot.vals = std::move(vals);
+    }
+
+public:
+    Echelon(const size_t columns) : pivots_(columns), acc_(columns, 0), 
+        p_(coeff::ModP::prime()), fold_(coeff::fold_constant(p_)), isa_(coeff::detect_isa()) {}
+
+    void add_pivot(const Row<coeff::ModP> &row) {
+        std::vector<uint32_t> cols, vals;
+        cols.reserve(row.size());
+        vals.reserve(row.size());
+        for (const std::pair<uint32_t, coeff::ModP> &entry : row) {
+            cols.push_back(entry.first);
+            vals.push_back(entry.second.value());
+        }
+        add_pivot(cols.front(), std::move(cols), std::move(vals));
+    }
+
+    bool reduce(const Row<coeff::ModP> &row, uint32_t &lead) {
+        for (const std::pair<uint32_t, coeff::ModP> &entry : row) acc_[entry.first] = entry.second.value();
+
+        std::vector<uint32_t> cols, vals;
+        for (uint32_t c = row.front().first; c < acc_.size(); c++) {
+            if (acc_[c] == 0) continue;
+            const uint32_t v = uint32_t(acc_[c] % p_);
+            acc_[c] = 0;
+            if (v == 0) continue;
+
+            const Pivot &pivot = pivots_[c];
+            if (pivot.cols.empty()) {
+                cols.push_back(c);
+                vals.push_back(v);
+            } else if (!pivot.dense.empty()) {
+                // The pivot is monic and its leading column is done, so it is skipped
+                coeff::axpy_dense(acc_.data() + c + 1, pivot.dense.data() + 1, pivot.dense.size() - 1, p_ - v, fold_, isa_);
+            } else {
+                coeff::axpy_sparse(acc_.data(), pivot.cols.data() + 1, pivot.vals.data() + 1, pivot.cols.size() - 1, 
+                        p_ - v, fold_);
+            }
+        }
+        if (cols.empty()) return false;
+
+        lead = cols.front();
+        add_pivot(lead, std::move(cols), std::move(vals));
+        return true;
+    }
+
+    Row<coeff::ModP> pivot(const uint32_t c) const {
+        Row<coeff::ModP> row;
+        row.reserve(pivots_[c].cols.size());
+        for (size_t i = 0; i < pivots_[c].cols.size(); i++) {
+            row.emplace_back(pivots_[c].cols[i], coeff::ModP(int64_t(pivots_[c].vals[i])));
+        }
+        return row;
+    }
+};
+
+// F4, see Faugere, A new efficient algorithm for computing Groebner bases (F4), 1999
+//
+// Each round takes every pair whose lcm has the smallest degree, and writes both halves of every
+// S polynomial as rows of one matrix, with a column for every mononode in them. Symbolic preprocessing
+// adds a multiple of some basis element for every column it can reduce, then the matrix is brought
+// to row echelon form. The rows whose leading mononodes are not leading mononodes of any original row
+// join the basis, everything else in the span of the matrix reduces to 0 by the basis and them
+template<class R>
+bool groebner::Reducer<R>::calculate_gbasis_f4() {
+    if (polys_.empty()) return true;
+
+    if (fraction_free_) {
+        for (Poly<R>* &p : polys_) p = make_primitive(p);
+    }
+
+    struct Pair {
+        int i, j;
+        algebra::MononodeId lcm;
+        int degree;
+    };
+    std::vector<Pair> pairs;
+    std::vector<std::vector<bool>> S_computed(polys_.size());
+
+    auto add_pairs = [this, &pairs, &S_computed](const int i) {
+        S_computed[i].resize(i);
+        for (int j = 0; j < i; j++) {
+            Mono<R>* lcm = polys_[i]->leading_m()->lcm(*polys_[j]->leading_m());
+            pairs.push_back({i, j, lcm->id, lcm->get_degree()});
+        }
+    };
+    for (size_t i = 1; i < polys_.size(); i++) add_pairs(i);
+
+    while (!pairs.empty() && !(stop_ && now() > stop_time_)) {
+        if (node_store_.get_polynode_store_size() > gc_threshold_) {
+            std::vector<algebra::MononodeId> mononode_roots;
+            mononode_roots.reserve(pairs.size());
+            for (const Pair &pair : pairs) mononode_roots.push_back(pair.lcm);
+            collect_garbage(mononode_roots);
+        }
+
+        // Normal strategy: every pair of the smallest degree
+        const int degree = std::min_element(pairs.begin(), pairs.end(), 
+                [](const Pair &lhs, const Pair &rhs) { return lhs.degree < rhs.degree; })->degree;
+        const auto split = std::partition(pairs.begin(), pairs.end(), 
+                [degree](const Pair &pair) { return pair.degree != degree; });
+        const std::vector<Pair> batch(split, pairs.end());
+        pairs.erase(split, pairs.end());
+
+        // The products that make up the rows, each mononode with whether a row already leads with it
+        std::vector<std::pair<Mono<R>*, Poly<R>*>> products;
+        std::unordered_map<algebra::MononodeId, bool> columns;
+        std::vector<algebra::MononodeId> todo;
+        std::unordered_set<uint64_t> seen;
+        auto add_product = [this, &products, &columns, &todo, &seen](Mono<R>* m, Poly<R>* g) {
+            if (!seen.insert(uint64_t(m->id) << 32 | g->id).second) return;
+            products.emplace_back(m, g);
+            for (const std::pair<algebra::MononodeId, R> &term : *g) {
+                const algebra::MononodeId c = (*m * *node_store_.get_mononode(term.first))->id;
+                if (columns.emplace(c, false).second) todo.push_back(c);
+            }
+        };
+
+        const int len = polys_.size();
+        std::vector<Pair> reduced_pairs;
+        for (const Pair &pair : batch) {
+            const int i = pair.i, j = pair.j;
+            Mono<R>* lcm = node_store_.get_mononode(pair.lcm);
+
+            // Buchberger's criteria, as in calculate_gbasis, against the pairs of earlier rounds
+            if (*(*polys_[i]->leading_m() * *polys_[j]->leading_m()) == *lcm) continue;
+            bool skip = false;
+            for (int k = 0; k < len && !skip; k++) {
+                skip = k != i && k != j && S_computed[std::max(i, k)][std::min(i, k)] 
+                    && S_computed[std::max(j, k)][std::min(j, k)] && lcm->divisible(*polys_[k]->leading_m());
+            }
+            if (skip) continue;
+
+            add_product(*lcm / *polys_[i]->leading_m(), polys_[i]);
+            add_product(*lcm / *polys_[j]->leading_m(), polys_[j]);
+            columns[lcm->id] = true;
+            reduced_pairs.push_back(pair);
+        }
+        const size_t pair_rows = products.size();
+
+        // Symbolic preprocessing: one reducer for every column some basis element divides
+        while (!todo.empty()) {
+            const algebra::MononodeId c = todo.back();
+            todo.pop_back();
+            if (columns[c]) continue;
+            columns[c] = true;
+
+            Mono<R>* m = node_store_.get_mononode(c);
+            for (Poly<R>* g : polys_) {
+                if (m->divisible(*g->leading_m())) {
+                    add_product(*m / *g->leading_m(), g);
+                    break;
+                }
+            }
+        }
+
+        // Columns in the order of the summands of a polynode, leading first
+        std::vector<algebra::MononodeId> monos;
+        monos.reserve(columns.size());
+        for (const std::pair<const algebra::MononodeId, bool> &c : columns) monos.push_back(c.first);
+        std::sort(monos.begin(), monos.end(), [this](const algebra::MononodeId lhs, const algebra::MononodeId rhs) {
+                    return node_store_.mononode_cmp(lhs, rhs) < 0;
+                });
+        std::unordered_map<algebra::MononodeId, uint32_t> column_of;
+        column_of.reserve(monos.size());
+        for (uint32_t c = 0; c < monos.size(); c++) column_of.emplace(monos[c], c);
+
+        std::vector<bool> original_lead(monos.size(), false);
+        Echelon<R> echelon(monos.size());
+
+        auto make_row = [this, &column_of](const std::pair<Mono<R>*, Poly<R>*> &product) {
+            Row<R> row;
+            row.reserve(product.second->end() - product.second->begin());
+            for (const std::pair<algebra::MononodeId, R> &term : *product.second) {
+                row.emplace_back(column_of.at((*product.first * *node_store_.get_mononode(term.first))->id), term.second);
+            }
+            return row;
+        };
+
+        // The reducers lead with distinct columns that no pair row leads with, so they are pivots as they are
+        for (size_t r = pair_rows; r < products.size(); r++) {
+            Row<R> row = make_row(products[r]);
+            original_lead[row.front().first] = true;
+            echelon.add_pivot(std::move(row));
+        }
+
+        std::vector<uint32_t> new_leads;
+        for (size_t r = 0; r < pair_rows && !(stop_ && now() > stop_time_); r++) {
+            const Row<R> row = make_row(products[r]);
+            original_lead[row.front().first] = true;
+
+            uint32_t lead;
+            if (echelon.reduce(row, lead)) new_leads.push_back(lead);
+        }
+        if (stop_ && now() > stop_time_) break;
+
+        for (const Pair &pair : reduced_pairs) S_computed[pair.i][pair.j] = true;
+
+        for (const uint32_t lead : new_leads) {
+            if (original_lead[lead]) continue;
+
+            const Row<R> row = echelon.pivot(lead);
+            std::vector<std::pair<algebra::MononodeId, R>> summands;
+            summands.reserve(row.size());
+            for (const std::pair<uint32_t, R> &entry : row) summands.emplace_back(monos[entry.first], entry.second);
+            Poly<R>* p = node_store_.polynode(summands);
+
+            polys_.push_back(fraction_free_ ? make_primitive(p) : p);
+            S_computed.emplace_back();
+            add_pairs(polys_.size() - 1);
+        }
+    }
+    return !(stop_ && now() > stop_time_);
+}
+
 template<class R>
 bool groebner::Reducer<R>::calculate_reduced_gbasis(int max_duration_ms) {
     stop_ = max_duration_ms > 0;
     stop_time_ = now() + std::chrono::milliseconds{max_duration_ms};
 
-    bool finished = calculate_gbasis();
+    bool finished = f4_ ? calculate_gbasis_f4() : calculate_gbasis();
     size_t len = polys_.size();
 
     //std::cout << "Made basis of size " << len << std::endl;
@@ -227,7 +630,8 @@ bool groebner::Reducer<R>::calculate_reduced_gbasis(int max_duration_ms) {
     std::vector<Poly<R>*> min_basis;
     for (size_t i = 0; i < len; i++) {
         if (!divisible[i]) {
-            min_basis.push_back(polys_[i]->scale(*node_store_.one_m(), 1 / polys_[i]->leading_c()));
+            min_basis.push_back(fraction_free_ 
+                    ? polys_[i] : polys_[i]->scale(*node_store_.one_m(), 1 / polys_[i]->leading_c()));
         }
     }
     len = min_basis.size();
@@ -250,6 +654,11 @@ bool groebner::Reducer<R>::calculate_reduced_gbasis(int max_duration_ms) {
         polys_.push_back(reduce(min_basis[i], after, min_basis.end(), polys_.begin(), polys_.end()));
     }
 
+    // Fraction free, the basis only becomes monic now
+    if (fraction_free_) {
+        for (Poly<R>* &p : polys_) p = p->scale(*node_store_.one_m(), 1 / p->leading_c());
+    }
+
     return finished;
 }
 
@@ -258,4 +667,28 @@ std::vector<groebner::Poly<R>*> groebner::Reducer<R>::get_polys() const {
     return polys_;
 }
 
+template<class R>
+bool groebner::Reducer<R>::verify(const std::vector<Poly<R>*> &polys) {
+    stop_ = false;
+
+    for (size_t i = 0; i < polys_.size(); i++) {
+        for (size_t j = 0; j < i; j++) {
+            // Buchberger's first criterion
+            Mono<R>* lcm = polys_[i]->leading_m()->lcm(*polys_[j]->leading_m());
+            if (*(*polys_[i]->leading_m() * *polys_[j]->leading_m()) == *lcm) continue;
+
+            if (lead_reduce(S_poly(polys_[i], polys_[j]), polys_.begin(), polys_.end()) != node_store_.zero_p()) {
+                return false;
+            }
+        }
+    }
+
+    for (Poly<R>* p : polys) {
+        if (lead_reduce(p, polys_.begin(), polys_.end()) != node_store_.zero_p()) return false;
+    }
+    return true;
+}
+
 template class groebner::Reducer<mpq_class>;
+template class groebner::Reducer<coeff::ModP>;
+template class groebner::Reducer<coeff::SmallQ>;
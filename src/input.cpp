@@ -1,14 +1,20 @@
 #include "../include/algebra.hpp"
+#include "../include/coeff.hpp"
 #include "../include/groebner.hpp"
+#include "../include/modular.hpp"
 #include "../include/randomize.hpp"
+#include "../include/substitute.hpp"
 #include "../include/input.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <istream>
 #include <string>
 #include <set>
+#include <thread>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 
 void clean(std::string &input) {
@@ -37,6 +43,18 @@ mpq_class parse_coeff(const std::string &input) {
     return mpq_class(input);
 }
 
+template<>
+coeff::ModP parse_coeff(const std::string &input) {
+    return coeff::parse_mod_p(input);
+}
+
+template<>
+coeff::SmallQ parse_coeff(const std::string &input) {
+    mpq_class q = parse_coeff<mpq_class>(input);
+    q.canonicalize();
+    return q;
+}
+
 // Input must be cleaned to work
 template<class R>
 const algebra::Polynode<R>* Input::InputHandler<R>::parse_polynode(const std::string &input) {
@@ -78,7 +96,7 @@ const algebra::Polynode<R>* Input::InputHandler<R>::parse_polynode(const std::st
             }
         }
 
-        std::unordered_map<algebra::NodeHash, int> mono_factors;
+        std::unordered_map<algebra::NodeId, int> mono_factors;
 
         const algebra::Polynode<R>* term = node_store_.one_p();
 
@@ -100,7 +118,7 @@ const algebra::Polynode<R>* Input::InputHandler<R>::parse_polynode(const std::st
                     throw std::invalid_argument("Failed to parse expression '" + input + 
                             "'. Unable to parse '" + input.substr(last, cur - last) + "', treated as variable.");
                 }
-                mono_factors[node_store_.node(var)->hash]++;
+                mono_factors[node_store_.node(var)->id]++;
             // f(polynode), so we must recurse
             } else if (input[last] == 'f') {
                 cur++;
@@ -119,8 +137,8 @@ const algebra::Polynode<R>* Input::InputHandler<R>::parse_polynode(const std::st
                 
                 std::string sub_polynode = input.substr(last + 2, cur - last - 3);
                 mono_factors[node_store_.node(
-                                parse_polynode(sub_polynode)->hash
-                             )->hash]++;
+                                parse_polynode(sub_polynode)->id
+                             )->id]++;
             // (polynode), again we must recurse
             } else if (input[last] == '(') {
                 cur++;
@@ -138,7 +156,7 @@ const algebra::Polynode<R>* Input::InputHandler<R>::parse_polynode(const std::st
                         "'. Invalid factor starting with '" + input[last] + "'.");
             }
         }
-        term = *term * *node_store_.polynode({{ node_store_.mononode(mono_factors)->hash, coeff }});
+        term = *term * *node_store_.polynode({{ node_store_.mononode(mono_factors)->id, coeff }});
         ans = *ans + *term;
 
         last = next;
@@ -251,9 +269,7 @@ bool Input::InputHandler<R>::handle_line(const std::string &input, int& line) {
 
 template<class R>
 Input::InputHandler<R>::InputHandler(std::istream &in, std::ostream &out, std::ostream &err, Arg opt) :
-    in_(in), out_(out), err_(err), opt_(opt) {
-    node_store_ = algebra::NodeStore<R>();
-}
+    in_(in), out_(out), err_(err), opt_(opt), node_store_(0, opt.cache_bits) {}
 
 template<class R>
 void Input::InputHandler<R>::take_input() {
@@ -288,15 +304,19 @@ void Input::InputHandler<R>::echo_rand_hypotheses() {
     }
 }
 
-// Quick and dirty function to get the variables in a polynode
-// TODO: make this better
+// The variables in a polynode, walking it only if some variable is out of range for VarSet
 template<class R>
 std::set<algebra::Idx> get_vars(const algebra::Polynode<R>& p, algebra::NodeStore<R> &node_store) {
+    if (p.stats.vars.exact()) {
+        const std::vector<algebra::Idx> vars = p.stats.vars.to_vector();
+        return std::set<algebra::Idx>(vars.begin(), vars.end());
+    }
+
     std::set<algebra::Idx> vars;
 
     for (const auto& term : p) {
         for (const auto &node : *node_store.get_mononode(term.first)) {
-            const algebra::Node<R>* nptr = node_store.get_node(node.first);
+            const algebra::Node<R>* nptr = node_store.get_node(node.id);
 
             switch (nptr->get_type()) {
                 case algebra::NodeType::VAR: {
@@ -304,7 +324,7 @@ std::set<algebra::Idx> get_vars(const algebra::Polynode<R>& p, algebra::NodeStor
                     break;
                 }
                 case algebra::NodeType::POL: {
-                    std::set<algebra::Idx> v = get_vars(*node_store.get_polynode(nptr->get_polynode_hash()), node_store);
+                    std::set<algebra::Idx> v = get_vars(*node_store.get_polynode(nptr->get_polynode_id()), node_store);
                     vars.insert(v.begin(), v.end());
                 }
             }
@@ -313,14 +333,102 @@ std::set<algebra::Idx> get_vars(const algebra::Polynode<R>& p, algebra::NodeStor
     return vars;
 }
 
+// Splits vars into blocks of variables that can be swapped without changing p.
+// Swapping is an equivalence, so it is enough to test against the first variable of each block.
+// Returns the block of each variable, labelled by the position of its first variable
+template<class R>
+std::vector<size_t> symmetric_blocks(const algebra::Polynode<R>& p, const std::vector<algebra::Idx> &vars) {
+    std::vector<size_t> blocks(vars.size());
+    std::vector<size_t> firsts;
+    for (size_t i = 0; i < vars.size(); i++) {
+        blocks[i] = i;
+        for (const size_t j : firsts) {
+            if (p.subs_var({{vars[i], vars[j]}, {vars[j], vars[i]}}) == &p) {
+                blocks[i] = j;
+                break;
+            }
+        }
+        if (blocks[i] == i) firsts.push_back(i);
+    }
+    return blocks;
+}
+
+// Every renaming of the variables of h onto x1, ..., xn, except for those that differ by a symmetry of h
+template<class R>
+std::vector<const algebra::Polynode<R>*> renamings(const algebra::Polynode<R>& h, algebra::NodeStore<R> &node_store) {
+    std::vector<const algebra::Polynode<R>*> permuted;
+    std::set<algebra::Idx> vars_set = get_vars(h, node_store);
+    std::vector<algebra::Idx> vars_idx(vars_set.begin(), vars_set.end());
+
+    // Renamings that differ by a symmetry of h give the same polynode,
+    // so the variables of a block only ever go to their new indexes in order
+    const std::vector<size_t> blocks = symmetric_blocks(h, vars_idx);
+    std::vector<std::vector<size_t>> members(vars_idx.size());
+    for (size_t i = 0; i < vars_idx.size(); i++) members[blocks[i]].push_back(i);
+
+    // Which block gets each new index, its distinct permutations are the distinct renamings
+    std::vector<size_t> arrangement(blocks);
+    std::sort(arrangement.begin(), arrangement.end());
+
+    do {
+        std::unordered_map<algebra::Idx, algebra::Idx> replace;
+        replace.reserve(vars_idx.size());
+
+        std::vector<size_t> used(vars_idx.size(), 0);
+        for (size_t k = 0; k < arrangement.size(); k++) {
+            const size_t b = arrangement[k];
+            replace[vars_idx[members[b][used[b]++]]] = algebra::Idx(k + 1);
+        }
+
+        permuted.push_back(h.subs_var(replace));
+    } while (std::next_permutation(arrangement.begin(), arrangement.end()));
+    return permuted;
+}
+
+// Expands every hypothesis into a list of new ones, on up to threads workers
+// 
+// Make: () -> Expand, called once per worker, and Expand: (const Polynode<R>&) -> std::vector<const Polynode<R>*>.
+// The lists are concatenated in the order of the hypotheses, so the result is the same for any number of threads
+template<class R, class Make>
+std::vector<const algebra::Polynode<R>*> expand_hypotheses(const std::vector<const algebra::Polynode<R>*> &hypotheses,
+        algebra::NodeStore<R> &node_store, const unsigned threads, Make&& make) {
+    std::vector<std::vector<const algebra::Polynode<R>*>> expanded(hypotheses.size());
+
+    if (threads <= 1 || hypotheses.size() <= 1) {
+        auto expand = make();
+        for (size_t i = 0; i < hypotheses.size(); i++) expanded[i] = expand(*hypotheses[i]);
+    } else {
+        node_store.set_concurrent(true);
+        std::atomic<size_t> next(0);
+        // The prime of coeff::ModP is per thread
+        const uint32_t prime = coeff::ModP::prime();
+
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < std::min<size_t>(threads, hypotheses.size()); t++) {
+            workers.emplace_back([&hypotheses, &expanded, &next, &make, prime]() {
+                        coeff::ModP::set_prime(prime);
+                        auto expand = make();
+                        for (size_t i = next++; i < hypotheses.size(); i = next++) expanded[i] = expand(*hypotheses[i]);
+                    });
+        }
+        for (std::thread &worker : workers) worker.join();
+        node_store.set_concurrent(false);
+    }
+
+    std::vector<const algebra::Polynode<R>*> res;
+    for (const std::vector<const algebra::Polynode<R>*> &ps : expanded) res.insert(res.end(), ps.begin(), ps.end());
+    return res;
+}
+
 template<class R>
 void Input::InputHandler<R>::clean_hypotheses() {
-    // Remove duplicates
-    std::set<const algebra::Polynode<R>*> reduced_hypotheses(hypotheses_.begin(), hypotheses_.end());
-    // Delete zeros
-    auto it = reduced_hypotheses.find(node_store_.zero_p());
-    if (it != reduced_hypotheses.end()) reduced_hypotheses.erase(it);
-    hypotheses_ = std::vector<const algebra::Polynode<R>*>(reduced_hypotheses.begin(), reduced_hypotheses.end());
+    // Remove duplicates and zeros, keeping the first of each in place
+    std::unordered_set<const algebra::Polynode<R>*> seen{node_store_.zero_p()};
+    std::vector<const algebra::Polynode<R>*> reduced_hypotheses;
+    for (const algebra::Polynode<R>* h : hypotheses_) {
+        if (seen.insert(h).second) reduced_hypotheses.push_back(h);
+    }
+    hypotheses_ = std::move(reduced_hypotheses);
 }
 
 template<class R>
@@ -329,49 +437,26 @@ void Input::InputHandler<R>::prepare_hypotheses() {
 
     // Substitute zeros
     if (opt_.simplify >= 1) {
-        std::vector<const algebra::Polynode<R>*> sub_zero;
-        for (const algebra::Polynode<R>* h : hypotheses_) {
-            // Again slow, but that's ok (probably). TODO
-            std::set<algebra::Idx> vars = get_vars(*h, node_store_);
-
-            for (int mask = 1; mask < (1 << vars.size()); mask++) {
-                int mask_copy = mask;
-                std::unordered_set<algebra::Idx> zero_out;
-                zero_out.reserve(vars.size());
-                for (const algebra::Idx v : vars) {
-                    if (mask_copy & 1) {
-                        zero_out.insert(v);
-                    } 
-                    mask_copy >>= 1;
-                }   
-                sub_zero.push_back(h->subs_zero(zero_out));
-            }
-        }
+        const std::vector<const algebra::Polynode<R>*> sub_zero = expand_hypotheses(hypotheses_, node_store_, opt_.threads,
+                [this]() {
+                    return [this, zeros = algebra::ZeroSubstituter<R>(node_store_)](const algebra::Polynode<R>& h) mutable {
+                        const std::set<algebra::Idx> vars = get_vars(h, node_store_);
+                        std::vector<const algebra::Polynode<R>*> subsets = 
+                            zeros.subsets(h, std::vector<algebra::Idx>(vars.begin(), vars.end()));
+                        subsets.erase(subsets.begin());
+                        return subsets;
+                    };
+                });
         
         hypotheses_.insert(hypotheses_.end(), sub_zero.begin(), sub_zero.end());
         clean_hypotheses();
     }
     // Permute the variables (and "push" them down to the n smallest indexes)
     if (opt_.simplify >= 2) {
-        std::vector<const algebra::Polynode<R>*> permuted;
-        for (const algebra::Polynode<R>* h : hypotheses_) {
-            // Again slow, but that's ok (probably). TODO
-            std::set<algebra::Idx> vars_set = get_vars(*h, node_store_);
-            std::vector<algebra::Idx> vars_idx(vars_set.begin(), vars_set.end());
-            std::vector<algebra::Idx> new_idx(vars_set.size()); 
-            std::iota(new_idx.begin(), new_idx.end(), 1);
-
-            do {
-                std::unordered_map<algebra::Idx, algebra::Idx> replace;
-                replace.reserve(vars_idx.size());
-                
-                for (size_t i = 0; i < vars_idx.size(); i++) {
-                    replace[vars_idx[i]] = new_idx[i];
-                }
-
-                permuted.push_back(h->subs_var(replace));
-            } while (std::next_permutation(new_idx.begin(), new_idx.end()));
-        }
+        const std::vector<const algebra::Polynode<R>*> permuted = expand_hypotheses(hypotheses_, node_store_, opt_.threads,
+                [this]() {
+                    return [this](const algebra::Polynode<R>& h) { return renamings(h, node_store_); };
+                });
         
         hypotheses_.insert(hypotheses_.end(), permuted.begin(), permuted.end());
         clean_hypotheses();
@@ -387,12 +472,35 @@ void Input::InputHandler<R>::prepare_hypotheses() {
     }
 }
 
+// Replaces polys by their reduced Groebner basis, returns whether it finished in time
+template<class R>
+bool reduced_gbasis(std::vector<const algebra::Polynode<R>*> &polys, algebra::NodeStore<R> &node_store,
+        const Input::Arg &opt, std::ostream &) {
+    groebner::Reducer<R> reducer(polys, node_store, opt.gc_threshold, opt.fraction_free, opt.f4);
+    bool finished = reducer.calculate_reduced_gbasis(opt.simplify_timeout);
+    polys = reducer.get_polys();
+    return finished;
+}
+
+// Over Q the basis can also be lifted from its images mod primes
+bool reduced_gbasis(std::vector<const algebra::Polynode<mpq_class>*> &polys, 
+        algebra::NodeStore<mpq_class> &node_store, const Input::Arg &opt, std::ostream &err) {
+    if (!opt.modular) return reduced_gbasis<mpq_class>(polys, node_store, opt, err);
+
+    groebner::ModularReducer reducer(polys, node_store, opt.gc_threshold, opt.cache_bits, opt.threads,
+            opt.fraction_free, opt.f4);
+    bool finished = reducer.calculate_reduced_gbasis(opt.simplify_timeout);
+    polys = reducer.get_polys();
+
+    if (opt.stats) err << "modular: " << reducer.get_primes_used() << " primes" << std::endl;
+    return finished;
+}
+
 template<class R>
 void Input::InputHandler<R>::calc_groebner() {
     if (opt_.pretty) out_ << "Calculating Groebner basis ..." << std::endl;
-    groebner::Reducer<R> reducer(hypotheses_, node_store_);
-    bool finished = reducer.calculate_reduced_gbasis(opt_.simplify_timeout);
-    std::vector<const algebra::Polynode<R>*> gbasis = reducer.get_polys();
+    std::vector<const algebra::Polynode<R>*> gbasis = hypotheses_;
+    bool finished = reduced_gbasis(gbasis, node_store_, opt_, err_);
     std::sort(gbasis.begin(), gbasis.end(), [](const algebra::Polynode<R>* a, const algebra::Polynode<R>* b) {
                 return a->stats.weight < b->stats.weight;
             });
@@ -428,7 +536,17 @@ void Input::InputHandler<R>::handle_input() {
         prepare_hypotheses();
         calc_groebner();
     }
+
+    if (opt_.stats) {
+        const algebra::ComputedTable &cache = node_store_.get_cache();
+        const size_t lookups = cache.hits() + cache.misses();
+        err_ << "cache: " << cache.hits() << " hits, " << cache.misses() << " misses";
+        if (lookups > 0) err_ << " (" << 100 * cache.hits() / lookups << "% hit rate)";
+        err_ << ", " << cache.capacity() << " entries" << std::endl;
+    }
 }
 
 //template class Input::InputHandler<int>;
 template class Input::InputHandler<mpq_class>;
+template class Input::InputHandler<coeff::ModP>;
+template class Input::InputHandler<coeff::SmallQ>;
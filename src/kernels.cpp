@@ -0,0 +1,97 @@
+#include "../include/kernels.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86_
+#endif
+
+namespace {
+inline uint64_t fold_scalar(const uint64_t x, const uint64_t fold) {
+    return x - (fold & (0 - (x >> 63)));
+}
+
+void axpy_dense_scalar(uint64_t* acc, const uint32_t* vals, const size_t n, const uint32_t f, const uint64_t fold) {
+    for (size_t i = 0; i < n; i++) acc[i] = fold_scalar(acc[i] + uint64_t(f) * vals[i], fold);
+}
+
+#ifdef KERNELS_X86_
+// Two lanes at a time: _mm_mul_epu32 multiplies the low 32 bits of each 64-bit lane
+__attribute__((target("sse2")))
+void axpy_dense_sse2(uint64_t* acc, const uint32_t* vals, const size_t n, const uint32_t f, const uint64_t fold) {
+    const __m128i vf = _mm_set1_epi64x(f);
+    const __m128i vfold = _mm_set1_epi64x(int64_t(fold));
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        const __m128i v = _mm_unpacklo_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(vals + i)), zero);
+        __m128i a = _mm_add_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(acc + i)), _mm_mul_epu32(v, vf));
+        const __m128i top = _mm_sub_epi64(zero, _mm_srli_epi64(a, 63));
+        a = _mm_sub_epi64(a, _mm_and_si128(top, vfold));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(acc + i), a);
+    }
+    axpy_dense_scalar(acc + i, vals + i, n - i, f, fold);
+}
+
+__attribute__((target("avx2")))
+void axpy_dense_avx2(uint64_t* acc, const uint32_t* vals, const size_t n, const uint32_t f, const uint64_t fold) {
+    const __m256i vf = _mm256_set1_epi64x(f);
+    const __m256i vfold = _mm256_set1_epi64x(int64_t(fold));
+    const __m256i zero = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256i v = _mm256_cvtepu32_epi64(_mm_loadu_si128(reinterpret_cast<const __m128i*>(vals + i)));
+        __m256i a = _mm256_add_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(acc + i)), 
+                _mm256_mul_epu32(v, vf));
+        const __m256i top = _mm256_sub_epi64(zero, _mm256_srli_epi64(a, 63));
+        a = _mm256_sub_epi64(a, _mm256_and_si256(top, vfold));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(acc + i), a);
+    }
+    axpy_dense_scalar(acc + i, vals + i, n - i, f, fold);
+}
+#endif
+};
+
+coeff::Isa coeff::detect_isa() {
+#ifdef KERNELS_X86_
+    static const Isa isa = __builtin_cpu_supports("avx2") ? Isa::avx2 
+        : (__builtin_cpu_supports("sse2") ? Isa::sse2 : Isa::scalar);
+    return isa;
+#else
+    return Isa::scalar;
+#endif
+}
+
+const char* coeff::isa_name(const Isa isa) {
+    switch (isa) {
+        case Isa::scalar: return "scalar";
+        case Isa::sse2: return "sse2";
+        case Isa::avx2: return "avx2";
+    }
+    return "";
+}
+
+uint64_t coeff::fold_constant(const uint32_t p) {
+    const uint64_t p2 = uint64_t(p) * p;
+    return ((uint64_t(1) << 63) / p2) * p2;
+}
+
+void coeff::axpy_dense(uint64_t* acc, const uint32_t* vals, const size_t n, const uint32_t f, 
+        const uint64_t fold, const Isa isa) {
+#ifdef KERNELS_X86_
+    switch (isa) {
+        case Isa::avx2: return axpy_dense_avx2(acc, vals, n, f, fold);
+        case Isa::sse2: return axpy_dense_sse2(acc, vals, n, f, fold);
+        case Isa::scalar: break;
+    }
+#else
+    (void)isa;
+#endif
+    axpy_dense_scalar(acc, vals, n, f, fold);
+}
+
+void coeff::axpy_sparse(uint64_t* acc, const uint32_t* cols, const uint32_t* vals, const size_t n, const uint32_t f,
+        const uint64_t fold) {
+    for (size_t i = 0; i < n; i++) acc[cols[i]] = fold_scalar(acc[cols[i]] + uint64_t(f) * vals[i], fold);
+}
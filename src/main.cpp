@@ -3,8 +3,6 @@
 #include <iostream>
 #include <string>
 
-typedef mpq_class R;
-
 const std::string truthies[] = { "true", "1", "yes" };
 
 bool truthy(std::string s) {
@@ -43,6 +41,27 @@ Input::Arg parse_arg(int argc, char** argv) {
             args.simplify = std::stoi(val);
         } else if (key == "simplify_timeout" || key == "simp_timeout") {
             args.simplify_timeout = std::stoi(val);
+        } else if (key == "cache") {
+            args.cache_bits = std::stoi(val);
+        } else if (key == "gc") {
+            args.gc_threshold = std::stoul(val);
+        } else if (key == "stats") {
+            args.stats = truthy(val);
+        } else if (key == "coeff") {
+            if (val == "q" || val == "rational") args.coeff = Input::rational;
+            else if (val == "modp" || val == "mod_p") args.coeff = Input::mod_p;
+            else if (val == "small") args.coeff = Input::small_rational;
+            else throw std::invalid_argument("Invalid coefficient field: " + val);
+        } else if (key == "prime") {
+            args.prime = std::stoul(val);
+        } else if (key == "modular") {
+            args.modular = truthy(val);
+        } else if (key == "fraction_free" || key == "ff") {
+            args.fraction_free = truthy(val);
+        } else if (key == "f4") {
+            args.f4 = truthy(val);
+        } else if (key == "threads") {
+            args.threads = std::stoul(val);
         }
     }
 
@@ -52,7 +71,17 @@ Input::Arg parse_arg(int argc, char** argv) {
 int main(int argc, char** argv) {
     Input::Arg arg = parse_arg(argc, argv);
 
-    Input::InputHandler<R> handler(std::cin, std::cout, std::cerr, arg);
-    handler.handle_input();
+    if (arg.coeff == Input::mod_p) {
+        coeff::ModP::set_prime(arg.prime);
+
+        Input::InputHandler<coeff::ModP> handler(std::cin, std::cout, std::cerr, arg);
+        handler.handle_input();
+    } else if (arg.coeff == Input::small_rational) {
+        Input::InputHandler<coeff::SmallQ> handler(std::cin, std::cout, std::cerr, arg);
+        handler.handle_input();
+    } else {
+        Input::InputHandler<mpq_class> handler(std::cin, std::cout, std::cerr, arg);
+        handler.handle_input();
+    }
 }
 
@@ -0,0 +1,299 @@
+#include "../include/modular.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+typedef coeff::ModP F;
+
+namespace {
+// A mononode by the ids of its nodes in the source store
+typedef std::vector<std::pair<algebra::NodeId, int>> Factors;
+
+// A reduced basis mod prime, in terms of the nodes of the source store
+struct Image {
+    uint32_t prime;
+    bool lucky = false;
+    bool finished = false;
+    std::vector<std::vector<std::pair<Factors, uint32_t>>> basis;
+};
+
+// Copies polynodes over Q into a store over Z/p, for the current prime of the thread
+//
+// The source store is only read, so several threads can copy from it at once
+class Reduction {
+private:
+    const algebra::NodeStore<mpq_class> &source_;
+    algebra::NodeStore<F> &target_;
+
+    std::unordered_map<algebra::NodeId, algebra::NodeId> nodes_;
+    std::unordered_map<algebra::NodeId, algebra::NodeId> back_;
+    std::unordered_map<algebra::PolynodeId, algebra::PolynodeId> polynodes_;
+
+    // A coefficient vanished, or two nodes became one
+    bool unlucky_ = false;
+
+    const algebra::Node<F>* node(const algebra::Node<mpq_class> &n) {
+        auto it = nodes_.find(n.id);
+        if (it != nodes_.end()) return target_.get_node(it->second);
+
+        const algebra::Node<F>* res = n.get_type() == algebra::NodeType::VAR
+            ? target_.node(n.get_var())
+            : target_.node(polynode(*source_.get_polynode(n.get_polynode_id()))->id);
+
+        nodes_.emplace(n.id, res->id);
+        unlucky_ |= !back_.emplace(res->id, n.id).second;
+        return res;
+    }
+
+    F coefficient(const mpq_class &c) {
+        const uint32_t p = F::prime();
+        const F num(int64_t(mpz_fdiv_ui(c.get_num_mpz_t(), p)));
+        const F den(int64_t(mpz_fdiv_ui(c.get_den_mpz_t(), p)));
+        if (num == 0 || den == 0) {
+            unlucky_ = true;
+            return 0;
+        }
+        return num / den;
+    }
+
+public:
+    Reduction(const algebra::NodeStore<mpq_class> &source, algebra::NodeStore<F> &target) :
+        source_(source), target_(target) {}
+
+    const algebra::Polynode<F>* polynode(const algebra::Polynode<mpq_class> &p) {
+        auto it = polynodes_.find(p.id);
+        if (it != polynodes_.end()) return target_.get_polynode(it->second);
+
+        std::vector<std::pair<algebra::MononodeId, F>> summands;
+        summands.reserve(p.end() - p.begin());
+        for (const auto &term : p) {
+            std::unordered_map<algebra::NodeId, int> factors;
+            for (const algebra::Factor &f : *source_.get_mononode(term.first)) {
+                factors.emplace(node(*source_.get_node(f.id))->id, f.exp);
+            }
+            summands.emplace_back(target_.mononode(factors)->id, coefficient(term.second));
+        }
+
+        const algebra::Polynode<F>* res = target_.polynode(summands);
+        polynodes_.emplace(p.id, res->id);
+        return res;
+    }
+
+    // The image is only usable if it has the same shape and the same node order as the source
+    bool lucky() const {
+        if (unlucky_) return false;
+
+        std::vector<std::pair<algebra::NodeId, algebra::NodeId>> pairs(nodes_.begin(), nodes_.end());
+        std::sort(pairs.begin(), pairs.end(), [this](const auto &lhs, const auto &rhs) {
+                    return source_.node_cmp(lhs.first, rhs.first) < 0;
+                });
+        for (size_t i = 1; i < pairs.size(); i++) {
+            if (target_.node_cmp(pairs[i - 1].second, pairs[i].second) >= 0) return false;
+        }
+        return true;
+    }
+
+    Factors factors(const algebra::Mononode<F> &m) const {
+        Factors res;
+        for (const algebra::Factor &f : m) res.emplace_back(back_.at(f.id), f.exp);
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+};
+
+Image compute_image(const std::vector<groebner::Poly<mpq_class>*> &polys,
+        const algebra::NodeStore<mpq_class> &source, const uint32_t prime,
+        const size_t gc_threshold, const int cache_bits, const bool f4, const int max_duration_ms) {
+    F::set_prime(prime);
+
+    Image image;
+    image.prime = prime;
+
+    algebra::NodeStore<F> store(source.get_seed(), cache_bits);
+    Reduction reduction(source, store);
+
+    std::vector<groebner::Poly<F>*> images;
+    images.reserve(polys.size());
+    for (groebner::Poly<mpq_class>* p : polys) images.push_back(reduction.polynode(*p));
+    if (!reduction.lucky()) return image;
+    image.lucky = true;
+
+    groebner::Reducer<F> reducer(images, store, gc_threshold, false, f4);
+    image.finished = reducer.calculate_reduced_gbasis(max_duration_ms);
+
+    for (groebner::Poly<F>* g : reducer.get_polys()) {
+        image.basis.emplace_back();
+        for (const auto &term : *g) {
+            image.basis.back().emplace_back(reduction.factors(*store.get_mononode(term.first)), term.second.value());
+        }
+    }
+    return image;
+}
+};
+
+std::vector<uint32_t> groebner::primes_below(const uint32_t below, const size_t n) {
+    std::vector<uint32_t> primes;
+    for (uint32_t c = below - 1; primes.size() < n && c > 2; c--) {
+        if (mpz_probab_prime_p(mpz_class(c).get_mpz_t(), 25)) primes.push_back(c);
+    }
+    return primes;
+}
+
+// Runs Euclid on (m, a) and stops at the first remainder below the bound, see Wang's algorithm
+bool groebner::rational_reconstruction(const mpz_class &a, const mpz_class &m, mpq_class &res) {
+    const mpz_class bound = sqrt(m / 2);
+
+    mpz_class r0 = m, r1 = a % m, t0 = 0, t1 = 1;
+    if (r1 < 0) r1 += m;
+    while (r1 > bound) {
+        const mpz_class q = r0 / r1;
+
+        mpz_class r2 = r0 - q * r1;
+        r0 = std::move(r1);
+        r1 = std::move(r2);
+
+        mpz_class t2 = t0 - q * t1;
+        t0 = std::move(t1);
+        t1 = std::move(t2);
+    }
+    if (t1 == 0 || abs(t1) > bound || gcd(r1, t1) != 1) return false;
+
+    res = mpq_class(r1, t1);
+    res.canonicalize();
+    return true;
+}
+
+groebner::ModularReducer::ModularReducer(std::vector<Poly<mpq_class>*> polys,
+        algebra::NodeStore<mpq_class> &node_store, size_t gc_threshold, int cache_bits, unsigned threads,
+        bool fraction_free, bool f4) :
+    input_(polys), node_store_(node_store), gc_threshold_(gc_threshold), cache_bits_(cache_bits),
+    threads_(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())), 
+    fraction_free_(fraction_free), f4_(f4), primes_used_(0) {}
+
+bool groebner::ModularReducer::calculate_over_q(int max_duration_ms) {
+    Reducer<mpq_class> reducer(input_, node_store_, gc_threshold_, fraction_free_, f4_);
+    const bool finished = reducer.calculate_reduced_gbasis(max_duration_ms);
+    polys_ = reducer.get_polys();
+    return finished;
+}
+
+bool groebner::ModularReducer::calculate_reduced_gbasis(int max_duration_ms) {
+    const auto stop_time = std::chrono::system_clock::now() + std::chrono::milliseconds{max_duration_ms};
+    auto remaining_ms = [max_duration_ms, &stop_time]() {
+        if (max_duration_ms <= 0) return -1;
+        const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                stop_time - std::chrono::system_clock::now()).count();
+        return int(std::max<decltype(left)>(left, 1));
+    };
+
+    polys_.clear();
+    if (input_.empty()) return true;
+
+    const std::vector<uint32_t> primes = primes_below(uint32_t(1) << 31, MAX_PRIMES);
+
+    // Lucky images so far, their mononodes interned in node_store_ and sorted by leading mononode
+    typedef std::vector<std::vector<std::pair<algebra::MononodeId, uint32_t>>> Basis;
+    std::vector<std::pair<uint32_t, Basis>> lifts;
+
+    while (primes_used_ < primes.size()) {
+        const size_t batch = std::min<size_t>(threads_, primes.size() - primes_used_);
+        std::vector<Image> images(batch);
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < batch; i++) {
+            workers.emplace_back([this, &images, &primes, i, max_ms = remaining_ms()]() {
+                        images[i] = compute_image(input_, node_store_, primes[primes_used_ + i],
+                                gc_threshold_, cache_bits_, f4_, max_ms);
+                    });
+        }
+        for (std::thread &worker : workers) worker.join();
+        primes_used_ += batch;
+
+        for (const Image &image : images) {
+            if (!image.lucky) continue;
+            // Out of time, it would be no faster over Q
+            if (!image.finished) return calculate_over_q(remaining_ms());
+
+            Basis basis;
+            for (const auto &g : image.basis) {
+                basis.emplace_back();
+                for (const auto &term : g) {
+                    std::unordered_map<algebra::NodeId, int> factors(term.first.begin(), term.first.end());
+                    basis.back().emplace_back(node_store_.mononode(factors)->id, term.second);
+                }
+            }
+            std::sort(basis.begin(), basis.end(), [this](const auto &lhs, const auto &rhs) {
+                        return node_store_.mononode_cmp(lhs.front().first, rhs.front().first) < 0;
+                    });
+            lifts.emplace_back(image.prime, std::move(basis));
+        }
+
+        // Primes that disagree with the majority on the monomials are unlucky
+        std::map<std::vector<std::vector<algebra::MononodeId>>, std::vector<size_t>> shapes;
+        for (size_t i = 0; i < lifts.size(); i++) {
+            std::vector<std::vector<algebra::MononodeId>> shape;
+            for (const auto &g : lifts[i].second) {
+                shape.emplace_back();
+                for (const auto &term : g) shape.back().push_back(term.first);
+            }
+            shapes[shape].push_back(i);
+        }
+        if (shapes.empty()) continue;
+        const std::vector<size_t> &majority = std::max_element(shapes.begin(), shapes.end(),
+                [](const auto &lhs, const auto &rhs) { return lhs.second.size() < rhs.second.size(); })->second;
+
+        // Chinese remaindering, one prime at a time
+        const Basis &first = lifts[majority.front()].second;
+        std::vector<std::vector<mpz_class>> crt;
+        for (const auto &g : first) crt.emplace_back(g.size(), 0);
+        mpz_class modulus = 1;
+        for (const size_t i : majority) {
+            const uint32_t p = lifts[i].first;
+            mpz_class inv;
+            const mpz_class mod_p(mpz_fdiv_ui(modulus.get_mpz_t(), p));
+            mpz_invert(inv.get_mpz_t(), mod_p.get_mpz_t(), mpz_class(p).get_mpz_t());
+
+            for (size_t j = 0; j < crt.size(); j++) {
+                for (size_t k = 0; k < crt[j].size(); k++) {
+                    const uint64_t a = lifts[i].second[j][k].second;
+                    const uint64_t a_mod_p = mpz_fdiv_ui(crt[j][k].get_mpz_t(), p);
+                    const uint64_t t = (a + p - a_mod_p) % p * inv.get_ui() % p;
+                    mpz_addmul_ui(crt[j][k].get_mpz_t(), modulus.get_mpz_t(), t);
+                }
+            }
+            modulus *= p;
+        }
+
+        // Rational reconstruction, and more primes if it fails
+        std::vector<Poly<mpq_class>*> lifted;
+        bool reconstructed = true;
+        for (size_t j = 0; j < crt.size() && reconstructed; j++) {
+            std::vector<std::pair<algebra::MononodeId, mpq_class>> summands;
+            summands.reserve(crt[j].size());
+            for (size_t k = 0; k < crt[j].size() && reconstructed; k++) {
+                summands.emplace_back(first[j][k].first, 0);
+                reconstructed = rational_reconstruction(crt[j][k], modulus, summands.back().second);
+            }
+            lifted.push_back(node_store_.polynode(summands));
+        }
+        if (!reconstructed) continue;
+
+        Reducer<mpq_class> check(lifted, node_store_, gc_threshold_);
+        if (check.verify(input_)) {
+            polys_ = lifted;
+            return true;
+        }
+    }
+    return calculate_over_q(remaining_ms());
+}
+
+std::vector<groebner::Poly<mpq_class>*> groebner::ModularReducer::get_polys() const {
+    return polys_;
+}
+
+size_t groebner::ModularReducer::get_primes_used() const {
+    return primes_used_;
+}
@@ -1,4 +1,5 @@
 #include "../include/randomize.hpp"
+#include "../include/coeff.hpp"
 
 #include <cmath>
 #include <gmpxx.h>
@@ -21,7 +22,7 @@ template<class R>
 std::string randomize::Randomizer<R>::to_random_string(const algebra::Node<R> &n) {
     switch (n.get_type()) {
         case algebra::NodeType::POL: return std::string("f(") + 
-            to_random_string(*node_store_.get_polynode(n.get_polynode_hash())) + std::string(")");
+            to_random_string(*node_store_.get_polynode(n.get_polynode_id())) + std::string(")");
         case algebra::NodeType::VAR: return std::string("x") + std::to_string(n.get_var());
     }
     return "";
@@ -31,11 +32,11 @@ template<class R>
 std::string randomize::Randomizer<R>::to_random_string(const algebra::Mononode<R> &m) {
     if (m.get_degree() == 0) return "";
 
-    std::vector<algebra::NodeHash> factors;
+    std::vector<algebra::NodeId> factors;
     factors.reserve(m.get_degree());
 
-    for (const std::pair<const algebra::NodeHash, int> &f : m) {
-        factors.insert(factors.end(), f.second, f.first);
+    for (const algebra::Factor &f : m) {
+        factors.insert(factors.end(), f.exp, f.id);
     }
 
     std::random_device rd;
@@ -62,8 +63,8 @@ constexpr double DROPOUT = 0.75;
 constexpr double VARIATION = 0.5;
 constexpr double SWITCH = 0.3;
 
-template<>
-mpq_class randomize::Randomizer<mpq_class>::add_noise(const mpq_class& x) {
+// A nearby fraction, with denominators about as large as the ones of x
+mpq_class rational_noise(const mpq_class& x, std::mt19937 &gen_, std::uniform_real_distribution<double> &dist01_) {
     double q = (1.0 + VARIATION * dist01_(gen_)) * x.get_d();
 
     double dropout = DROPOUT;
@@ -86,11 +87,30 @@ mpq_class randomize::Randomizer<mpq_class>::add_noise(const mpq_class& x) {
     return mpq_class(best_num * (dist01_(gen_) < SWITCH ? -1 : 1), best_den);
 }
 
+template<>
+mpq_class randomize::Randomizer<mpq_class>::add_noise(const mpq_class& x) {
+    return rational_noise(x, gen_, dist01_);
+}
+
+template<>
+coeff::SmallQ randomize::Randomizer<coeff::SmallQ>::add_noise(const coeff::SmallQ& x) {
+    mpq_class q = rational_noise(x.get_mpq(), gen_, dist01_);
+    q.canonicalize();
+    return q;
+}
+
+// There is no size to perturb mod p, so pick a small nonzero multiplier and maybe switch the sign
+template<>
+coeff::ModP randomize::Randomizer<coeff::ModP>::add_noise(const coeff::ModP& x) {
+    const int scale = 1 + int(VARIATION * 8 * dist01_(gen_));
+    return x * coeff::ModP(dist01_(gen_) < SWITCH ? -scale : scale);
+}
+
 template<class R>
 std::string randomize::Randomizer<R>::to_random_string(const algebra::Polynode<R> &p, bool noisy) {
     if (p.begin() == p.end()) return "0";
 
-    std::vector<std::pair<algebra::MononodeHash, R>> summands(p.begin(), p.end());
+    std::vector<std::pair<algebra::MononodeId, R>> summands(p.begin(), p.end());
 
     if (noisy) {
         for (auto it = summands.begin(); it != summands.end();) {
@@ -134,4 +154,6 @@ std::string randomize::Randomizer<R>::to_random_string(const algebra::Polynode<R
 
 //template class randomize::Randomizer<int>;
 template class randomize::Randomizer<mpq_class>;
+template class randomize::Randomizer<coeff::ModP>;
+template class randomize::Randomizer<coeff::SmallQ>;
 
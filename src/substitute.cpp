@@ -0,0 +1,168 @@
+#include "../include/substitute.hpp"
+#include "../include/coeff.hpp"
+#include "../include/geobucket.hpp"
+
+#include <tuple>
+#include <utility>
+
+#include <gmpxx.h>
+
+template<class R>
+algebra::Substituter<R>::Substituter(NodeStore<R> &node_store, std::unordered_map<Idx, const Polynode<R>*> replace) :
+    node_store_(node_store), replace_(std::move(replace))  {
+    for (const std::pair<const Idx, const Polynode<R>*> &entry : replace_) replaced_ |= VarSet::of(entry.first);
+}
+
+template<class R>
+typename algebra::Substituter<R>::Image algebra::Substituter<R>::node(const Node<R>& n) {
+    auto it = nodes_.find(n.id);
+    if (it != nodes_.end()) return it->second;
+
+    Image image{n.id, false, nullptr};
+    if (n.get_type() == NodeType::POL) {
+        image.node = node_store_.node(apply(*node_store_.get_polynode(n.get_polynode_id()))->id)->id;
+    } else {
+        auto rep = replace_.find(n.get_var());
+        if (rep != replace_.end()) {
+            const Polynode<R>* val = rep->second;
+            const Mononode<R>* m = val->begin() == val->end() ? nullptr : val->leading_m();
+
+            // Zeros and single nodes keep the terms they land in monomials
+            if (m == nullptr) {
+                image.zero = true;
+            } else if (val->end() - val->begin() == 1 && val->leading_c() == 1 
+                    && m->end() - m->begin() == 1 && m->begin()->exp == 1) {
+                image.node = m->begin()->id;
+            } else {
+                image.poly = val;
+            }
+        }
+    }
+    nodes_.emplace(n.id, image);
+    return image;
+}
+
+// Square and multiply, every intermediate power is kept
+template<class R>
+const algebra::Polynode<R>* algebra::Substituter<R>::power(const Node<R>& n, const int exp) {
+    if (exp == 1) return node(n).poly;
+
+    const uint64_t key = uint64_t(n.id) << 32 | uint32_t(exp);
+    auto it = powers_.find(key);
+    if (it != powers_.end()) return node_store_.get_polynode(it->second);
+
+    const Polynode<R>* res = exp % 2 == 0 
+        ? *power(n, exp / 2) * *power(n, exp / 2)
+        : *power(n, exp - 1) * *node(n).poly;
+    powers_.emplace(key, res->id);
+    return res;
+}
+
+template<class R>
+const algebra::Polynode<R>* algebra::Substituter<R>::apply(const Polynode<R>& p) {
+    if (!p.stats.vars.intersects(replaced_)) return &p;
+
+    auto it = polynodes_.find(p.id);
+    if (it != polynodes_.end()) return node_store_.get_polynode(it->second);
+
+    // Images of the terms, nullptr for a term that is unchanged
+    std::vector<std::pair<const Mononode<R>*, const Polynode<R>*>> images;
+    images.reserve(p.end() - p.begin());
+    bool changed = false;
+
+    for (const std::pair<MononodeId, R> &term : p) {
+        std::unordered_map<NodeId, int> factors;
+        const Polynode<R>* rest = nullptr;
+        bool zero = false, same = true;
+
+        for (const Factor &factor : *node_store_.get_mononode(term.first)) {
+            const Node<R>& n = *node_store_.get_node(factor.id);
+            const Image image = node(n);
+            if (image.zero) {
+                zero = true;
+                break;
+            }
+
+            if (image.poly == nullptr) {
+                factors[image.node] += factor.exp;
+                same &= image.node == factor.id;
+            } else {
+                rest = rest == nullptr ? power(n, factor.exp) : *rest * *power(n, factor.exp);
+                same = false;
+            }
+        }
+
+        if (zero) {
+            images.emplace_back(nullptr, node_store_.zero_p());
+            changed = true;
+        } else if (same) {
+            images.emplace_back(nullptr, nullptr);
+        } else {
+            images.emplace_back(node_store_.mononode(factors), rest == nullptr ? node_store_.one_p() : rest);
+            changed = true;
+        }
+    }
+
+    const Polynode<R>* res = &p;
+    if (changed) {
+        // The images need not be in order any more, the geobucket sorts them out
+        Geobucket<R> sum(node_store_);
+        size_t i = 0;
+        for (const std::pair<MononodeId, R> &term : p) {
+            const std::pair<const Mononode<R>*, const Polynode<R>*> &image = images[i++];
+            if (image.second == nullptr) {
+                sum.add_scaled(term.second, *node_store_.get_mononode(term.first), *node_store_.one_p());
+            } else if (image.first != nullptr) {
+                sum.add_scaled(term.second, *image.first, *image.second);
+            }
+        }
+        res = sum.to_polynode();
+    }
+
+    polynodes_.emplace(p.id, res->id);
+    return res;
+}
+
+template<class R>
+std::vector<const algebra::Polynode<R>*> algebra::Substituter<R>::apply(const std::vector<const Polynode<R>*> &ps) {
+    std::vector<const Polynode<R>*> res;
+    res.reserve(ps.size());
+    for (const Polynode<R>* p : ps) res.push_back(apply(*p));
+    return res;
+}
+
+template<class R>
+algebra::ZeroSubstituter<R>::ZeroSubstituter(NodeStore<R> &node_store) : node_store_(node_store) {}
+
+template<class R>
+algebra::Substituter<R>& algebra::ZeroSubstituter<R>::zero(const Idx var) {
+    auto it = zeros_.find(var);
+    if (it == zeros_.end()) {
+        it = zeros_.emplace(std::piecewise_construct, std::forward_as_tuple(var), 
+                std::forward_as_tuple(node_store_, std::unordered_map<Idx, const Polynode<R>*>{
+                        {var, node_store_.zero_p()}
+                    })).first;
+    }
+    return it->second;
+}
+
+template<class R>
+std::vector<const algebra::Polynode<R>*> algebra::ZeroSubstituter<R>::subsets(const Polynode<R>& p, 
+        const std::vector<Idx> &vars) {
+    std::vector<const Polynode<R>*> res(size_t(1) << vars.size());
+    res[0] = &p;
+    for (size_t mask = 1; mask < res.size(); mask++) {
+        const size_t low = mask & -mask;
+        res[mask] = zero(vars[__builtin_ctzll(low)]).apply(*res[mask ^ low]);
+    }
+    return res;
+}
+
+//template class algebra::Substituter<int>;
+template class algebra::Substituter<mpq_class>;
+template class algebra::Substituter<coeff::ModP>;
+template class algebra::Substituter<coeff::SmallQ>;
+
+template class algebra::ZeroSubstituter<mpq_class>;
+template class algebra::ZeroSubstituter<coeff::ModP>;
+template class algebra::ZeroSubstituter<coeff::SmallQ>;
@@ -1,5 +1,10 @@
 #include "../include/algebra.hpp"
+#include "../include/coeff.hpp"
+#include "../include/geobucket.hpp"
 #include "../include/input.hpp"
+#include "../include/kernels.hpp"
+#include "../include/modular.hpp"
+#include "../include/substitute.hpp"
 
 #include <cassert>
 #include <chrono>
@@ -9,6 +14,8 @@
 #include <iomanip>
 #include <set>
 #include <string>
+#include <thread>
+#include <unordered_set>
 
 #include <gmpxx.h>
 
@@ -23,12 +30,12 @@ void test_algebra() {
     const algebra::Node<R>* a = ns.node(3);
     const algebra::Node<R>* b = ns.node(4);
 
-    const algebra::Polynode<R>* px = ns.polynode({{ns.mononode({{x->hash, 1}})->hash, 1}});
-    const algebra::Polynode<R>* py = ns.polynode({{ns.mononode({{y->hash, 1}})->hash, 1}});
+    const algebra::Polynode<R>* px = ns.polynode({{ns.mononode({{x->id, 1}})->id, 1}});
+    const algebra::Polynode<R>* py = ns.polynode({{ns.mononode({{y->id, 1}})->id, 1}});
 
     const algebra::Polynode<R>* x_plus_y = ns.polynode({
-            {ns.mononode({{x->hash, 1}})->hash, 1},
-            {ns.mononode({{y->hash, 1}})->hash, 1}
+            {ns.mononode({{x->id, 1}})->id, 1},
+            {ns.mononode({{y->id, 1}})->id, 1}
         });
 
     assert(*px + *py == x_plus_y);
@@ -42,34 +49,99 @@ void test_algebra() {
     assert(z->to_string() == "0");
 
     const algebra::Polynode<R>* fzero = ns.polynode({{
-            ns.mononode({{ns.node(ns.zero_p()->hash)->hash, 1}})->hash, 1
+            ns.mononode({{ns.node(ns.zero_p()->id)->id, 1}})->id, 1
         }});
 
     assert(!(*fzero == *ns.zero_p()));
     assert(fzero->to_string() == "f(0)");
 
     const algebra::Polynode<R>* a_plus_b = ns.polynode({
-            {ns.mononode({{a->hash, 1}})->hash, 1},
-            {ns.mononode({{b->hash, 1}})->hash, 1}
+            {ns.mononode({{a->id, 1}})->id, 1},
+            {ns.mononode({{b->id, 1}})->id, 1}
         });
 
     const algebra::Polynode<R>* foil = ns.polynode({
-            {ns.mononode({{a->hash, 1}, {x->hash, 1}})->hash, 1}, 
-            {ns.mononode({{a->hash, 1}, {y->hash, 1}})->hash, 1}, 
-            {ns.mononode({{b->hash, 1}, {x->hash, 1}})->hash, 1}, 
-            {ns.mononode({{b->hash, 1}, {y->hash, 1}})->hash, 1},
+            {ns.mononode({{a->id, 1}, {x->id, 1}})->id, 1}, 
+            {ns.mononode({{a->id, 1}, {y->id, 1}})->id, 1}, 
+            {ns.mononode({{b->id, 1}, {x->id, 1}})->id, 1}, 
+            {ns.mononode({{b->id, 1}, {y->id, 1}})->id, 1},
         });
 
     assert(*x_plus_y * *a_plus_b == foil);
 
+    // Derived hashes must agree with hashes computed from scratch
+    const algebra::Mononode<R>* xxy = ns.mononode({{x->id, 2}, {y->id, 1}});
+    assert(*xxy / *ns.mononode({{x->id, 1}}) == ns.mononode({{x->id, 1}, {y->id, 1}}));
+    assert(*xxy / *xxy == ns.one_m());
+    assert(*x_plus_y->scale(*xxy, R(-2, 3)) == *ns.polynode({
+            {ns.mononode({{x->id, 3}, {y->id, 1}})->id, R(-2, 3)},
+            {ns.mononode({{x->id, 2}, {y->id, 2}})->id, R(-2, 3)}
+        }));
+
+    // Packed and general mononodes agree, including across the lane and exponent limits of the packing
+    const algebra::NodeId fx_id = ns.node(px->id)->id;
+    const std::vector<algebra::NodeId> monomial_nodes = {ns.node(0)->id, x->id, y->id, ns.node(7)->id, 
+        ns.node(8)->id, ns.node(15)->id, ns.node(16)->id, fx_id};
+    const int exps[] = {0, 0, 1, 2, 5, 64, 100, 127};
+    uint32_t seed = 1;
+    auto random_exps = [&]() {
+        std::unordered_map<algebra::NodeId, int> res;
+        for (const algebra::NodeId n : monomial_nodes) {
+            seed = seed * 1103515245 + 12345;
+            const int exp = exps[(seed >> 16) % 8];
+            if (exp == 0) continue;
+            // x16 and f(x1) only now and then, so that both are usually packed
+            if ((n == monomial_nodes[6] || n == fx_id) && (seed >> 8) % 4 != 0) continue;
+            res[n] = exp;
+        }
+        return res;
+    };
+    for (int i = 0; i < 500; i++) {
+        std::unordered_map<algebra::NodeId, int> lhs = random_exps(), rhs = random_exps();
+        if (i % 3 == 0) {
+            rhs.clear();
+            for (const std::pair<const algebra::NodeId, int> &f : lhs) rhs[f.first] = f.second / 2;
+        }
+        const algebra::Mononode<R>* ml = ns.mononode(lhs);
+        const algebra::Mononode<R>* mr = ns.mononode(rhs);
+
+        std::unordered_map<algebra::NodeId, int> product = lhs, lcm = lhs, q_lhs, q_rhs;
+        bool divisible = true;
+        for (const std::pair<const algebra::NodeId, int> &f : rhs) {
+            product[f.first] += f.second;
+            lcm[f.first] = std::max(lcm[f.first], f.second);
+            divisible &= lhs.count(f.first) && lhs.at(f.first) >= f.second;
+        }
+        for (const std::pair<const algebra::NodeId, int> &f : lcm) {
+            q_lhs[f.first] = f.second - (lhs.count(f.first) ? lhs.at(f.first) : 0);
+            q_rhs[f.first] = f.second - (rhs.count(f.first) ? rhs.at(f.first) : 0);
+        }
+
+        assert(*ml * *mr == ns.mononode(product));
+        assert(ml->lcm(*mr) == ns.mononode(lcm));
+        assert(ml->symmetric_q(*mr) == std::make_pair(ns.mononode(q_lhs), ns.mononode(q_rhs)));
+        assert(ml->divisible(*mr) == divisible);
+        // The sieve never rejects a true divisor
+        if (divisible) assert((mr->get_sieve() & ~ml->get_sieve()) == 0);
+        if (divisible) assert(*ml / *mr == ns.mononode(q_rhs));
+    }
+
+    // The fused this - c m q agrees with scaling and subtracting, with or without cancelling leads
+    const algebra::Polynode<R>* xxy_x_plus_y = ns.polynode({{xxy->id, 1}, {ns.mononode({{x->id, 1}})->id, 1}});
+    assert(xxy_x_plus_y->sub_scaled(R(1, 2), *ns.mononode({{x->id, 1}, {y->id, 1}}), *x_plus_y)
+            == *xxy_x_plus_y - *x_plus_y->scale(*ns.mononode({{x->id, 1}, {y->id, 1}}), R(1, 2)));
+    assert(x_plus_y->sub_scaled(1, *ns.one_m(), *x_plus_y) == ns.zero_p());
+    assert(x_plus_y->sub_scaled(-1, *ns.one_m(), *n_x_plus_y) == ns.zero_p());
+    assert(px->sub_scaled(1, *ns.one_m(), *py) == *px - *py);
+
     int N = 28; // Needs to be small to avoid overflow
 
-    std::vector<std::pair<algebra::MononodeHash, R>> binom_summands;
+    std::vector<std::pair<algebra::MononodeId, R>> binom_summands;
     binom_summands.reserve(N + 1);
 
     R coeff = 1;
     for (int i = 0; i <= N; i++) {
-        binom_summands.emplace_back(ns.mononode({{x->hash, N - i}, {y->hash, i}})->hash, coeff);
+        binom_summands.emplace_back(ns.mononode({{x->id, N - i}, {y->id, i}})->id, coeff);
 
         coeff *= N - i;
         coeff /= i + 1;
@@ -82,10 +154,13 @@ void test_algebra() {
     const algebra::Polynode<R>* binom = ns.polynode(binom_summands);
 
     assert(*binom == *xy_prod);
+
+    // Like terms that cancel in the middle of a product are dropped
+    assert((*x_plus_y * *(*px - *py))->to_string() == (*(*px * *px) - *(*py * *py))->to_string());
     assert(*py->sub(2, *px) == *px);
     
-    const algebra::Polynode<R>* fx = ns.polynode({{ns.mononode({{ns.node(px->hash)->hash, 1}})->hash, 1}});
-    const algebra::Polynode<R>* ffoil = ns.polynode({{ns.mononode({{ns.node(foil->hash)->hash, 1}})->hash, 1}});
+    const algebra::Polynode<R>* fx = ns.polynode({{ns.mononode({{ns.node(px->id)->id, 1}})->id, 1}});
+    const algebra::Polynode<R>* ffoil = ns.polynode({{ns.mononode({{ns.node(foil->id)->id, 1}})->id, 1}});
 
     assert(*fx->sub(1, *foil) == *ffoil);
 
@@ -95,26 +170,34 @@ void test_algebra() {
                 { ns.node(
                     ns.polynode({
                         { ns.mononode({ 
-                            { ns.node(px->hash)->hash, 1 },
-                            { y->hash, 1 },
-                        })->hash, 1}, 
-                    })->hash
-                )->hash, 1 },
-            })->hash, 1},
+                            { ns.node(px->id)->id, 1 },
+                            { y->id, 1 },
+                        })->id, 1}, 
+                    })->id
+                )->id, 1 },
+            })->id, 1},
             {ns.mononode({ 
-                { ns.node(px->hash)->hash, 1 },
-                { ns.node(x_plus_y->hash)->hash, 1 },
-            })->hash, 2}, 
+                { ns.node(px->id)->id, 1 },
+                { ns.node(x_plus_y->id)->id, 1 },
+            })->id, 2}, 
             {ns.mononode({ 
-                { ns.node(py->hash)->hash, 1 },
-                { x->hash, 2 },
-            })->hash, -3}, 
+                { ns.node(py->id)->id, 1 },
+                { x->id, 2 },
+            })->id, -3}, 
         });
 
     const algebra::Polynode<R>* polynodes[] = {binom, foil, fancy};
 
+    // Variables are collected through f(polynode)s at interning time
+    assert(fancy->stats.vars.to_vector() == std::vector<algebra::Idx>({1, 2}));
+    assert(fancy->stats.vars.exact() && fancy->stats.vars.contains(2) && !fancy->stats.vars.contains(3));
+    assert(px->stats.vars.subset_of(fancy->stats.vars) && !foil->stats.vars.subset_of(fancy->stats.vars));
+    assert(ns.one_p()->stats.vars.empty());
+    const algebra::VarSet far = ns.polynode({{ns.mononode({{ns.node(100)->id, 1}})->id, 1}})->stats.vars;
+    assert(!far.exact() && far.contains(100) && far.to_vector().empty());
+
     const algebra::Node<R>* t = ns.node(10);
-    const algebra::Polynode<R>* pt = ns.polynode({{ns.mononode({{t->hash, 1}})->hash, 1}});
+    const algebra::Polynode<R>* pt = ns.polynode({{ns.mononode({{t->id, 1}})->id, 1}});
     for (const algebra::Polynode<R>* p : polynodes) {
         assert(*p->sub(1, *ns.zero_p()) == *p->subs_zero({1}));
         assert(*p->sub(2, *ns.zero_p()) == *p->subs_zero({2}));
@@ -126,26 +209,371 @@ void test_algebra() {
     }
 
     const algebra::Polynode<R>* x_pow = ns.polynode({{
-            ns.mononode({{x->hash, N}})->hash,
+            ns.mononode({{x->id, N}})->id,
         (1 << N)}});
 
     assert(*xy_prod->sub(2, *px) == *x_pow);
     assert(*xy_prod->subs_var({{1, 3}, {2, 3}}) == *x_pow->subs_var({{1, 3}}));
 
     const algebra::Polynode<R>* fx_minus_fy = ns.polynode({
-            {ns.mononode({{ns.node(px->hash)->hash, 1}})->hash, 1},
-            {ns.mononode({{ns.node(py->hash)->hash, 1}})->hash, -1}
+            {ns.mononode({{ns.node(px->id)->id, 1}})->id, 1},
+            {ns.mononode({{ns.node(py->id)->id, 1}})->id, -1}
         });
 
     assert(*fx_minus_fy == *(*px - *py)->apply_func(*py));
     assert(*fx_minus_fy->subs_var({{1, 2}, {2, 1}}) == *(-*fx_minus_fy));
     assert(*fx_minus_fy->subs_zero({1, 2}) == *ns.zero_p());
 
+    // Repeated arithmetic is answered by the computed table
+    size_t hits = ns.get_cache().hits();
+    assert(*x_plus_y * *a_plus_b == foil);
+    assert(*a_plus_b * *x_plus_y == foil);
+    assert(ns.get_cache().hits() == hits + 2);
+
+    algebra::NodeStore<R> uncached(0, 0);
+    const algebra::Polynode<R>* ux = uncached.polynode({{uncached.mononode({{uncached.node(1)->id, 1}})->id, 1}});
+    assert((*ux * *ux)->to_string() == (*px * *px)->to_string());
+    assert(uncached.get_cache().hits() == 0 && uncached.get_cache().capacity() == 0);
+
+    // Scalings are keyed without interning the term, so only the result is new
+    const algebra::Mononode<R>* uxx = uncached.mononode({{uncached.node(1)->id, 2}});
+    const size_t before_scale = uncached.get_polynode_store_size();
+    ux->scale(*uxx, 5);
+    assert(uncached.get_polynode_store_size() == before_scale + 1);
+
+    hits = ns.get_cache().hits();
+    assert(x_plus_y->scale(*xxy, R(-2, 7)) == x_plus_y->scale(*xxy, R(-2, 7)));
+    assert(x_plus_y->sub_scaled(R(3, 11), *xxy, *px) == x_plus_y->sub_scaled(R(3, 11), *xxy, *px));
+    assert(ns.get_cache().hits() == hits + 2);
+    assert(x_plus_y->scale(*xxy, R(-2, 7)) != x_plus_y->scale(*xxy, R(2, 7)));
+
+    // Distinct rationals with the same double approximation must not be merged
+    const algebra::Polynode<R>* third = ns.polynode({{ns.one_m()->id, R(1, 3)}});
+    const algebra::Polynode<R>* near_third = ns.polynode({{ns.one_m()->id,
+            R("333333333333333333333333333/1000000000000000000000000000")}});
+    assert(third->leading_c().get_d() == near_third->leading_c().get_d());
+    assert(*third != *near_third);
+    assert(*(*third - *near_third) != *ns.zero_p());
+
+    // Garbage collection keeps exactly what is reachable from the pins and roots
+    const std::string ffoil_str = ffoil->to_string();
+    ns.pin(x_plus_y);
+    size_t live_count = ns.get_polynode_store_size();
+    assert(ns.collect({ffoil->id}) > 0);
+    assert(ns.get_polynode_store_size() < live_count);
+    assert(ffoil->to_string() == ffoil_str);
+
+    const algebra::Polynode<R>* a_plus_b2 = ns.polynode({
+            {ns.mononode({{a->id, 1}})->id, 1},
+            {ns.mononode({{b->id, 1}})->id, 1}
+        });
+    const algebra::Polynode<R>* foil2 = *x_plus_y * *a_plus_b2;
+    assert(ns.polynode({{ns.mononode({{ns.node(foil2->id)->id, 1}})->id, 1}}) == ffoil);
+    assert(ns.collect() > 0);
+    assert(*x_plus_y - *x_plus_y == ns.zero_p());
+    ns.unpin(x_plus_y);
+
+    // Trimming gives back the dead tail of an arena, and the ids there are handed out again in order
+    algebra::Arena<std::string> arena;
+    for (int i = 0; i < 1000; i++) arena.emplace(std::to_string(i));
+    for (algebra::Id id = 5; id < 1000; id++) if (id != 7) arena.erase(id);
+    arena.trim();
+    assert(arena.size() == 8 && arena.count() == 6 && arena[7] == "7" && !arena.alive(500));
+    assert(arena.emplace("a") != 8 && arena.emplace("b") != 8 && arena.emplace("c") == 8);
+
+    // After a reset, everything is interned again from scratch
+    size_t polynode_count = ns.get_polynode_store_size();
+    ns.reset();
+    assert(ns.get_polynode_store_size() < polynode_count);
+    assert(ns.get_node_store_size() == 0);
+
+    const algebra::Polynode<R>* px2 = ns.polynode({{ns.mononode({{ns.node(1)->id, 1}})->id, 1}});
+    const algebra::Polynode<R>* py2 = ns.polynode({{ns.mononode({{ns.node(2)->id, 1}})->id, 1}});
+    assert((*px2 + *py2)->to_string() == x_plus_y->to_string());
+    assert(*(*px2 - *px2) == *ns.zero_p());
+
     std::cout << "algebra: " << std::fixed << std::setprecision(3)
               << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
               << std::endl;
 }
 
+void test_geobucket() {
+    clock_t tStart = clock();
+
+    algebra::NodeStore<R> ns;
+    const algebra::Mononode<R>* x = ns.mononode({{ns.node(1)->id, 1}});
+    const algebra::Mononode<R>* y = ns.mononode({{ns.node(2)->id, 1}});
+    const algebra::Polynode<R>* x_plus_y = ns.polynode({{x->id, 1}, {y->id, 1}});
+    const algebra::Polynode<R>* x_minus_y = ns.polynode({{x->id, 1}, {y->id, -1}});
+
+    // (x + y)^2 - (x + y)(x - y) - 2 y (x + y) = 0, one term at a time
+    algebra::Geobucket<R> g(ns, *(*x_plus_y * *x_plus_y));
+    g.add_scaled(-1, *x, *x_minus_y);
+    g.add_scaled(-1, *y, *x_minus_y);
+    assert(g.leading() != nullptr);
+    assert(g.to_polynode() == x_plus_y->scale(*y, 2));
+
+    g.add_scaled(-2, *y, *x_plus_y);
+    assert(g.leading() == nullptr);
+    assert(g.to_polynode() == ns.zero_p());
+
+    // (x + y) + c (x - y) with the leading terms cancelling, either 2x or 2y
+    const R c = -x_plus_y->leading_c() / x_minus_y->leading_c();
+    algebra::Geobucket<R> k(ns, *x_plus_y);
+    k.cancel_leading(c, *ns.one_m(), *x_minus_y);
+    assert(k.to_polynode() == *x_plus_y + *x_minus_y->scale(*ns.one_m(), c));
+
+    // Many short additions to a long polynomial
+    algebra::Geobucket<R> h(ns);
+    const algebra::Polynode<R>* sum = ns.zero_p();
+    for (int i = 1; i <= 100; i++) {
+        const algebra::Polynode<R>* term = ns.polynode({{ns.mononode({{ns.node(i % 7 + 1)->id, i % 5 + 1}})->id, i}});
+        h.add_scaled(1, *ns.one_m(), *term);
+        sum = *sum + *term;
+    }
+    assert(h.to_polynode() == sum);
+    assert(h.leading()->first == sum->leading_m()->id && h.leading()->second == sum->leading_c());
+
+    std::cout << "geobucket: " << std::fixed << std::setprecision(3)
+              << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
+              << std::endl;
+}
+
+void test_substitute() {
+    clock_t tStart = clock();
+
+    algebra::NodeStore<R> ns;
+    const algebra::Mononode<R>* x = ns.mononode({{ns.node(1)->id, 1}});
+    const algebra::Mononode<R>* y = ns.mononode({{ns.node(2)->id, 1}});
+    const algebra::Polynode<R>* px = ns.polynode({{x->id, 1}});
+    const algebra::Polynode<R>* py = ns.polynode({{y->id, 1}});
+    const algebra::Polynode<R>* x_plus_y = ns.polynode({{x->id, 1}, {y->id, 1}});
+
+    // g_{k + 1} = f(g_k) + f(g_k)^2, every level uses the one below twice
+    auto tower = [&ns](const algebra::Polynode<R>* g, const int depth) {
+        for (int k = 0; k < depth; k++) {
+            const algebra::NodeId f = ns.node(g->id)->id;
+            g = ns.polynode({{ns.mononode({{f, 1}})->id, 1}, {ns.mononode({{f, 2}})->id, 1}});
+        }
+        return g;
+    };
+    const int depth = 40;
+    const algebra::Polynode<R>* g = tower(x_plus_y, depth);
+
+    assert(g->sub(1, *py) == tower(py->scale(*ns.one_m(), 2), depth));
+    assert(g->subs_var({{1, 2}}) == tower(py->scale(*ns.one_m(), 2), depth));
+    assert(g->subs_zero({1}) == tower(py, depth));
+
+    // Powers of the value are built by squaring
+    const algebra::Polynode<R>* x_pow = ns.polynode({{ns.mononode({{ns.node(1)->id, 11}})->id, 1}});
+    const algebra::Polynode<R>* xy_pow = ns.one_p();
+    for (int i = 0; i < 11; i++) xy_pow = *xy_pow * *x_plus_y;
+    assert(x_pow->sub(1, *x_plus_y) == xy_pow);
+
+    // One substitution for several polynodes, the shared parts are only rewritten once
+    algebra::Substituter<R> sub(ns, {{1, x_plus_y}, {2, ns.zero_p()}});
+    const std::vector<const algebra::Polynode<R>*> subbed = sub.apply({g, x_pow, px, py});
+    assert(subbed.size() == 4);
+    assert(subbed[0] == tower(x_plus_y->subs_zero({2})->sub(1, *x_plus_y), depth));
+    assert(subbed[1] == x_pow->sub(2, *ns.zero_p())->sub(1, *x_plus_y));
+    assert(subbed[2] == x_plus_y && subbed[3] == ns.zero_p());
+
+    // Every subset of {x1, x2, x3} set to zero, against doing each one from scratch
+    const algebra::Polynode<R>* pz = ns.polynode({{ns.mononode({{ns.node(3)->id, 1}})->id, 1}});
+    const algebra::Polynode<R>* mixed = *tower(*x_plus_y + *pz, 3) + *(*px * *pz);
+    algebra::ZeroSubstituter<R> zeros(ns);
+    const std::vector<const algebra::Polynode<R>*> subsets = zeros.subsets(*mixed, {1, 2, 3});
+    assert(subsets.size() == 8 && subsets[0] == mixed);
+    for (size_t mask = 0; mask < subsets.size(); mask++) {
+        std::unordered_set<algebra::Idx> vars;
+        for (algebra::Idx v = 1; v <= 3; v++) {
+            if (mask >> (v - 1) & 1) vars.insert(v);
+        }
+        assert(subsets[mask] == mixed->subs_zero(vars));
+    }
+    assert(subsets[5] == tower(py, 3));
+
+    std::cout << "substitute: " << std::fixed << std::setprecision(3)
+              << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
+              << std::endl;
+}
+
+void test_concurrent() {
+    clock_t tStart = clock();
+
+    // Every thread builds the same polynodes, in a different order, into one store
+    auto build = [](algebra::NodeStore<R> &ns, const int start) {
+        std::vector<const algebra::Polynode<R>*> res(16);
+        for (int k = 0; k < 16; k++) {
+            const int i = (start + k) % 16;
+            const algebra::Polynode<R>* x = ns.polynode({{ns.mononode({{ns.node(i % 4 + 1)->id, 1}})->id, 1}});
+            const algebra::Polynode<R>* y = ns.polynode({{ns.mononode({{ns.node(i % 3 + 1)->id, 1}})->id, 1}});
+            const algebra::Polynode<R>* fy = ns.polynode({{ns.mononode({{ns.node(y->id)->id, 1}})->id, 2}});
+            const algebra::Polynode<R>* base = *(*ns.one_p() + *x) + *fy;
+
+            const algebra::Polynode<R>* p = ns.one_p();
+            for (int e = 0; e < 4 + i % 3; e++) p = *p * *base;
+            res[i] = *p - *x->apply_func(*fy);
+        }
+        return res;
+    };
+
+    algebra::NodeStore<R> serial;
+    const std::vector<const algebra::Polynode<R>*> expected = build(serial, 0);
+
+    algebra::NodeStore<R> shared;
+    shared.set_concurrent(true);
+    const int n_threads = 8;
+    std::vector<std::vector<const algebra::Polynode<R>*>> results(n_threads);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&shared, &results, &build, t]() { results[t] = build(shared, 2 * t); });
+    }
+    for (std::thread &t : threads) t.join();
+    shared.set_concurrent(false);
+
+    for (int t = 0; t < n_threads; t++) assert(results[t] == results[0]);
+    for (size_t i = 0; i < expected.size(); i++) assert(results[0][i]->to_string() == expected[i]->to_string());
+    assert(shared.get_polynode_store_size() == serial.get_polynode_store_size());
+
+    std::cout << "concurrent: " << std::fixed << std::setprecision(3)
+              << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
+              << std::endl;
+}
+
+void test_coeff() {
+    clock_t tStart = clock();
+
+    typedef coeff::ModP F;
+    F::set_prime(101);
+
+    assert(F(100) == F(-1) && F(-101) == 0 && F(205) == 3);
+    assert(F(50) + F(60) == 9 && F(3) - F(5) == -2 && F(20) * F(10) == 99);
+    for (int i = 1; i < 101; i++) assert(F(i) * F(i).inverse() == 1);
+    assert(F(1) / F(2) == 51);
+
+    // 1/2, -2/3 and -7 reconstruct, 10 is no fraction with both parts below sqrt(101 / 2)
+    int64_t num, den;
+    assert(F(51).rational(num, den) && num == 1 && den == 2);
+    assert((F(-2) / F(3)).rational(num, den) && num == -2 && den == 3);
+    assert(coeff::to_string(F(1) / F(2)) == "1/2" && coeff::to_string(F(-7)) == "-7");
+    assert(!F(10).rational(num, den) && coeff::to_string(F(10)) == "10");
+    assert(F(-1) < 0 && F(1) / F(2) > 0 && abs(F(-2) / F(3)) == F(2) / F(3));
+
+    assert(coeff::parse_mod_p("+3/6") == F(1) / F(2) && coeff::parse_mod_p("-4") == -4);
+    bool threw = false;
+    try { coeff::parse_mod_p("1/202"); } catch (const std::invalid_argument &e) { threw = true; }
+    assert(threw);
+
+    // The same hypotheses give the same output over Q and over a large prime
+    F::set_prime(F::DEFAULT_PRIME);
+    const std::string input =
+        "hyp x1 + f(x2 * x1 + x3) - f(2 x1) * f(x3) * x2\n"
+        "hyp 1/2 f(f(x1 + x2)) - f(2 x1) - 2/3 f(x2)\n"
+        "sub h2 x1 0\n"
+        "end";
+    Input::Arg opt;
+    opt.simplify = 2;
+
+    std::istringstream q_in(input), p_in(input), s_in(input);
+    std::stringstream q_out, q_err, p_out, p_err, s_out, s_err;
+    Input::InputHandler<R>(q_in, q_out, q_err, opt).handle_input();
+    Input::InputHandler<F>(p_in, p_out, p_err, opt).handle_input();
+    Input::InputHandler<coeff::SmallQ>(s_in, s_out, s_err, opt).handle_input();
+    assert(p_out.str() == q_out.str());
+    assert(s_out.str() == q_out.str());
+
+    // And so does the F4 engine, whose rows over Z/p go through the kernels
+    Input::Arg f4_opt = opt;
+    f4_opt.f4 = true;
+    std::istringstream f4_q_in(input), f4_p_in(input);
+    std::stringstream f4_q_out, f4_q_err, f4_p_out, f4_p_err;
+    Input::InputHandler<R>(f4_q_in, f4_q_out, f4_q_err, f4_opt).handle_input();
+    Input::InputHandler<F>(f4_p_in, f4_p_out, f4_p_err, f4_opt).handle_input();
+    assert(f4_p_out.str() == f4_q_out.str());
+
+    // Every instruction set up to the detected one agrees with plain arithmetic mod p,
+    // also after enough row operations that the accumulators have to fold
+    const uint32_t p = F::DEFAULT_PRIME;
+    const uint64_t fold = coeff::fold_constant(p);
+    assert(fold % (uint64_t(p) * p) == 0 && fold <= uint64_t(1) << 63 && (uint64_t(1) << 63) - fold < uint64_t(p) * p);
+    const size_t n = 37;
+    std::vector<uint32_t> vals(n), cols(n);
+    for (size_t i = 0; i < n; i++) {
+        vals[i] = uint32_t((i * 2654435761u + 12345) % p);
+        cols[i] = uint32_t(3 * i + i % 2);
+    }
+    for (int isa = 0; isa <= int(coeff::detect_isa()); isa++) {
+        std::vector<uint64_t> acc(3 * n + 1, 0);
+        std::vector<F> expected(3 * n + 1, 0);
+        for (uint32_t f = p - 1; f > p - 200; f--) {
+            coeff::axpy_dense(acc.data() + 1, vals.data(), n, f, fold, coeff::Isa(isa));
+            coeff::axpy_sparse(acc.data(), cols.data(), vals.data(), n, f, fold);
+            for (size_t i = 0; i < n; i++) {
+                expected[i + 1] += F(int64_t(f)) * F(int64_t(vals[i]));
+                expected[cols[i]] += F(int64_t(f)) * F(int64_t(vals[i]));
+            }
+        }
+        for (size_t i = 0; i < acc.size(); i++) assert(acc[i] % p == expected[i].value());
+    }
+    assert(std::string(coeff::isa_name(coeff::Isa::scalar)) == "scalar");
+
+    // Small rationals agree with mpq_class across the int64 boundary, both ways
+    typedef coeff::SmallQ Q;
+    const int64_t big = int64_t(1) << 62;
+    assert(Q(6, -4) == Q(-3, 2) && Q(6, -4).den() == 2 && Q(1, 3) + Q(1, 6) == Q(1, 2));
+    assert(Q(2, 3) * Q(3, 2) == 1 && Q(1, 2) - Q(1, 2) == 0 && (Q(1, 2) - Q(1, 2)).den() == 1);
+    assert(Q(-1) < Q(1, 3) && abs(Q(-5, 7)) == Q(5, 7) && Q(7) / Q(-14) == Q(-1, 2));
+
+    const Q sum = Q(big) + Q(big), product = Q(big) * Q(big, 3);
+    assert(!sum.is_small() && sum.get_mpq() == 2 * mpq_class(mpz_class(big)));
+    assert(!product.is_small() && product.get_mpq() == mpq_class(mpz_class(big) * big, 3));
+    assert((sum - Q(big)).is_small() && sum - Q(big) == Q(big));
+    assert(product / Q(big) == Q(big, 3) && (product / Q(big)).is_small());
+    assert(coeff::to_string(Q(-3, 9)) == "-1/3" && coeff::to_string(sum) == sum.get_mpq().get_str());
+
+    std::cout << "coeff: " << std::fixed << std::setprecision(3)
+              << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
+              << std::endl;
+}
+
+void test_modular() {
+    clock_t tStart = clock();
+
+    std::vector<uint32_t> primes = groebner::primes_below(100, 4);
+    assert((primes == std::vector<uint32_t>{97, 89, 83, 79}));
+
+    mpq_class q;
+    assert(groebner::rational_reconstruction(mpz_class(51), mpz_class(101), q) && q == mpq_class(1, 2));
+    assert(!groebner::rational_reconstruction(mpz_class(10), mpz_class(101), q));
+
+    // Coefficients much larger than one prime, so several primes must be combined
+    algebra::NodeStore<R> ns;
+    const algebra::Mononode<R>* x = ns.mononode({{ns.node(1)->id, 1}});
+    const algebra::Mononode<R>* y = ns.mononode({{ns.node(2)->id, 1}});
+    const algebra::Mononode<R>* fx = ns.mononode({{ns.node(ns.polynode({{x->id, R(2, 3)}})->id)->id, 1}});
+    std::vector<const algebra::Polynode<R>*> polys{
+        ns.polynode({{(*x * *y)->id, R("24691357802469/19753")}, {fx->id, 1}, {ns.one_m()->id, -7}}),
+        ns.polynode({{(*x * *x)->id, 1}, {y->id, R("-5555555555/3")}}),
+        ns.polynode({{(*fx * *x)->id, 2}, {y->id, 1}})
+    };
+
+    groebner::Reducer<R> over_q(polys, ns);
+    over_q.calculate_reduced_gbasis();
+    groebner::ModularReducer modular(polys, ns, groebner::Reducer<R>::DEFAULT_GC_THRESHOLD,
+            algebra::NodeStore<R>::DEFAULT_CACHE_BITS, 2);
+    assert(modular.calculate_reduced_gbasis());
+    assert(modular.get_primes_used() > 2);
+
+    std::vector<const algebra::Polynode<R>*> expected = over_q.get_polys(), lifted = modular.get_polys();
+    assert(std::set<const algebra::Polynode<R>*>(expected.begin(), expected.end())
+            == std::set<const algebra::Polynode<R>*>(lifted.begin(), lifted.end()));
+
+    std::cout << "modular: " << std::fixed << std::setprecision(3)
+              << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
+              << std::endl;
+}
+
 void test_input() {
     clock_t tStart = clock();
 
@@ -192,6 +620,93 @@ void test_input() {
 
     assert(errors.size() == 0);
 
+    // Collecting garbage on every iteration must not change the result
+    Input::Arg gc_opt;
+    gc_opt.gc_threshold = 0;
+    std::istringstream gc_in(in.str());
+    std::stringstream gc_out, gc_err;
+    Input::InputHandler<R> gc_handler(gc_in, gc_out, gc_err, gc_opt);
+    gc_handler.handle_input();
+    assert(gc_out.str() == out.str());
+
+    // So must fraction free reduction, over both kinds of rationals
+    Input::Arg ff_opt;
+    ff_opt.fraction_free = true;
+    std::istringstream ff_in(in.str()), ff_small_in(in.str());
+    std::stringstream ff_out, ff_err, ff_small_out, ff_small_err;
+    Input::InputHandler<R>(ff_in, ff_out, ff_err, ff_opt).handle_input();
+    Input::InputHandler<coeff::SmallQ>(ff_small_in, ff_small_out, ff_small_err, ff_opt).handle_input();
+    assert(ff_out.str() == out.str());
+    assert(ff_small_out.str() == out.str());
+
+    // Making a polynomial primitive clears its denominators, even once the gcd of the numerators is 1
+    algebra::NodeStore<R> ff_store;
+    const algebra::MononodeId ff_x = ff_store.mononode({{ff_store.node(1)->id, 1}})->id, ff_one = ff_store.one_m()->id;
+    const algebra::Polynode<R>* x_plus_half = ff_store.polynode({{ff_x, 1}, {ff_one, R(1, 2)}});
+    groebner::Reducer<R> ff_reducer({x_plus_half}, ff_store, groebner::Reducer<R>::DEFAULT_GC_THRESHOLD, true);
+    assert(ff_reducer.make_primitive(x_plus_half) == ff_store.polynode({{ff_x, 2}, {ff_one, 1}}));
+    assert(ff_reducer.make_primitive(ff_store.polynode({{ff_x, R(2, 3)}, {ff_one, R(4, 9)}})) 
+            == ff_store.polynode({{ff_x, 3}, {ff_one, 2}}));
+
+    // And so must reducing the pairs in batches
+    Input::Arg f4_opt;
+    f4_opt.f4 = true;
+    std::istringstream f4_in(in.str()), f4_small_in(in.str());
+    std::stringstream f4_out, f4_err, f4_small_out, f4_small_err;
+    Input::InputHandler<R>(f4_in, f4_out, f4_err, f4_opt).handle_input();
+    Input::InputHandler<coeff::SmallQ>(f4_small_in, f4_small_out, f4_small_err, f4_opt).handle_input();
+    assert(f4_out.str() == out.str());
+    assert(f4_small_out.str() == out.str());
+
+    // Renamings only differ up to the symmetry x1 <-> x2, and that must not lose any of them
+    Input::Arg perm_opt;
+    perm_opt.simplify = 2;
+    std::istringstream perm_in("hyp f(x1 + x2) - f(x1) - f(x2) + x3\nend");
+    std::stringstream perm_out, perm_err;
+    Input::InputHandler<R>(perm_in, perm_out, perm_err, perm_opt).handle_input();
+    std::set<std::string> permuted;
+    while (std::getline(perm_out, output)) {
+        if (output[0] == 's') permuted.insert(output.substr(output.find_first_of(":") + 2));
+    }
+    assert(permuted.size() == 7);
+    assert(permuted.count("-f(x2) - f(x3) + f(x3 + x2) + x1") == 1);
+    assert(permuted.count("-f(x1) - f(x3) + f(x3 + x1) + x2") == 1);
+
+    // The substitutions may run on several threads, with the same output
+    Input::Arg threads_opt = perm_opt;
+    threads_opt.threads = 4;
+    std::istringstream serial_in(in.str()), threads_in(in.str());
+    std::stringstream serial_out, serial_err, threads_out, threads_err;
+    Input::InputHandler<R>(serial_in, serial_out, serial_err, perm_opt).handle_input();
+    Input::InputHandler<R>(threads_in, threads_out, threads_err, threads_opt).handle_input();
+    assert(threads_out.str() == serial_out.str());
+
+    // Lifting from the images mod primes gives the same basis, also with the primes on a bounded number of threads.
+    // Elements of equal weight may come out in another order, so the output is compared as a set of lines
+    // (without the numbering)
+    auto unordered = [](const std::string &s) {
+        std::istringstream lines(s);
+        std::multiset<std::string> res;
+        std::string line;
+        while (std::getline(lines, line)) res.insert(line.substr(line.find_first_of(" ") + 1));
+        return res;
+    };
+    Input::Arg modular_opt;
+    modular_opt.modular = true;
+    modular_opt.threads = 2;
+    std::istringstream modular_in(in.str());
+    std::stringstream modular_out, modular_err;
+    Input::InputHandler<R>(modular_in, modular_out, modular_err, modular_opt).handle_input();
+    assert(unordered(modular_out.str()) == unordered(out.str()));
+
+    // And so does computing the images with F4
+    Input::Arg modular_f4_opt = modular_opt;
+    modular_f4_opt.f4 = true;
+    std::istringstream modular_f4_in(in.str());
+    std::stringstream modular_f4_out, modular_f4_err;
+    Input::InputHandler<R>(modular_f4_in, modular_f4_out, modular_f4_err, modular_f4_opt).handle_input();
+    assert(unordered(modular_f4_out.str()) == unordered(out.str()));
+
     std::cout << "input: " << std::fixed << std::setprecision(3)
               << (double)(clock() - tStart) / CLOCKS_PER_SEC << "s"
               << std::endl;
@@ -199,6 +714,11 @@ void test_input() {
 
 int main() {
     test_algebra();
+    test_geobucket();
+    test_substitute();
+    test_concurrent();
+    test_coeff();
+    test_modular();
     test_input();
 }
 